@@ -1,24 +1,162 @@
 /*  
  * ヘッダーファイルのインクルード  
+ * - fallocateのFALLOC_FL_PUNCH_HOLEを使うため_GNU_SOURCEを定義  
  */  
+#define _GNU_SOURCE  
 #include <stdio.h>   // 標準入出力関数用  
 #include <stdlib.h>  // メモリ管理、文字列変換関数用  
 #include <string.h>  // 文字列操作関数用  
 #include <ctype.h>   // 文字種判定関数用  
 #include <errno.h>   // エラー処理用  
-#include <math.h>
+#include <stdint.h>  // 64ビット整数型用  
+#include <fcntl.h>     // open, fallocate用  
+#include <unistd.h>    // close, ftruncate用  
+#include <sys/mman.h>  // mmap, msync, munmap用  
+#include <sys/stat.h>  // fstat用  
+#include <sys/ioctl.h> // 端末の大きさ（TIOCGWINSZ）用  
+#include <pthread.h>   // 描画スレッド用  
+#include <poll.h>      // 入力が溜まっているかの確認用  
+#include <time.h>      // 描画の間隔（clock_gettime）用  
+
+/*
+ * キャンバスのデータの持ち方
+ * - CANVAS_DENSE: 全セルを行優先の1次元配列として一括で確保
+ *   （--canvas-file 指定時はファイルをmmapした領域を使う）
+ * - CANVAS_TILED: CANVAS_TILE x CANVAS_TILE のタイルに分割し、
+ *   初めて書き込まれたタイルだけを確保する（未確保のタイルは空白として読む）
+ */
+typedef enum {
+    CANVAS_DENSE,
+    CANVAS_TILED
+} CanvasBackend;
+
+/*
+ * タイル方式の1タイル
+ * - genがキャンバスのgenと異なるタイルはreset_canvasより前に書かれたもので、
+ *   中身に関わらず空白として読む（次に書き込むときに消去して使い回す）
+ */
+typedef struct {
+    uint32_t gen;       // 最後に書き込んだときのキャンバスの世代
+    uint32_t reserved;  // cellsを8バイト境界に揃えるための詰め物
+    uint8_t cells[];    // CANVAS_TILE行分の格納値（行優先）
+} Tile;
+
+/*
+ * キャンバス上の長方形領域（両端を含む）
+ * - x1 < x0 のときは空の領域を表す
+ */
+typedef struct {
+    int64_t x0, y0;  // 左上
+    int64_t x1, y1;  // 右下
+} CanvasRect;
+
+/*
+ * パレットに登録できる文字数の上限（空白を含む）
+ * - 1セル1ビットの間は「空白」と「ペン1種類」の2つ、1セル4ビットなら16まで
+ * - 実際の上限は 1 << bpp
+ */
+#define CANVAS_PALETTE_MAX 16
+#define CANVAS_NO_INDEX 0xFF  // pal_indexで未登録を表す値
 
 /*  
  * キャンバスを表現する構造体  
  * - 描画領域の管理に使用  
  */  
 typedef struct {  
-    int width;      // キャンバスの幅  
-    int height;     // キャンバスの高さ  
-    char **canvas;  // 実際の描画データを保持する2次元配列  
+    int64_t width;      // キャンバスの幅  
+    int64_t height;     // キャンバスの高さ  
+    CanvasBackend backend;  // データの持ち方
+    int bpp;        // 1セルあたりのビット数（1, 4: パレットの番号、8: 文字そのもの）
+    size_t stride;  // 1行分のバイト数（CANVAS_ALIGN の倍数に切り上げたもの、DENSEのみ）
+    uint8_t *data;  // 描画データ（行優先で連続した1次元配列、y行目は data + y * stride、DENSEのみ）
+    int64_t tiles_x;    // 横方向のタイル数（TILEDのみ）
+    int64_t tiles_y;    // 縦方向のタイル数（TILEDのみ）
+    Tile **tiles;       // タイルへのポインタ配列（tiles[ty * tiles_x + tx]、未確保はNULL、TILEDのみ）
+    uint32_t gen;       // タイルの世代（reset_canvasのたびに1増える、TILEDのみ）
+    int fd;         // mmapしているファイルの記述子（ファイル方式でなければ-1）
+    void *map;      // mmapした領域の先頭（ヘッダを含む）
+    size_t map_size;  // mmapした領域のバイト数
+    int base_fd;    // 既存のファイルから再開したときの内容の写し（なければ-1、reset_canvasで書き戻す）
+    int npalette;   // パレットに登録済みの文字数（bpp < 8 のときのみ使用）
+    char palette[CANVAS_PALETTE_MAX];  // 格納値 → 文字（palette[0]は常に空白）
+    uint8_t pal_index[256];  // 文字 → 格納値（未登録はCANVAS_NO_INDEX）
+    CanvasRect dirty;  // 前回canvas_clear_dirtyしてから書き換わった範囲（を含む長方形）
+    CanvasRect view;   // 端末に表示する範囲（render_canvasはこの範囲だけを出力する）
+    int64_t view_cols; // 表示するセル数（横、1セルが何セル分かはcanvas_cell_w / canvas_cell_h）
+    int64_t view_rows; // 表示するセル数（縦）
+    int64_t zoom;      // 縮小率（1なら等倍）
+    int braille;       // 1なら点字で表示する（表示の1セルが横2 x 縦4ドット）
     char pen;       // 描画に使用する文字  
+    int64_t brush;  // 線の太さ（セル数、line / rect / circleに使う）
 } Canvas;  
 
+/*
+ * セルの格納値
+ * - 空白は0として格納する（bpp == 8 でも' 'ではなく0）
+ * - callocやftruncateで作った領域、穴あけ（hole punching）した領域が
+ *   そのまま空白のキャンバスとして読める
+ * - bpp == 8 のときは文字そのもの、bpp < 8 のときはパレットの番号
+ */
+#define CELL_BLANK 0
+
+static inline uint8_t cell_encode(const char ch){
+    return (ch == ' ') ? CELL_BLANK : (uint8_t)ch;
+}
+
+static inline char cell_decode(const uint8_t v){
+    return (v == CELL_BLANK) ? ' ' : (char)v;
+}
+
+/*
+ * --canvas-file で使うファイルの先頭に置くヘッダ
+ * - データ本体はCANVAS_FILE_HEADERバイト目（ページ境界）から始まる
+ * - 再起動時にサイズが一致するかをここで確認する
+ * - ファイル方式のセルは常に1セル8ビット
+ */
+typedef struct {
+    char magic[8];   // "PAINTCV1"
+    int64_t width;   // キャンバスの幅
+    int64_t height;  // キャンバスの高さ
+    int64_t stride;  // 1行分のバイト数
+} CanvasFileHeader;
+
+#define CANVAS_FILE_MAGIC "PAINTCV1"
+#define CANVAS_FILE_HEADER 4096
+
+/*
+ * 行の先頭を揃える境界（バイト）
+ * - 各行の先頭がワード境界に揃うようにstrideを切り上げる
+ */
+#define CANVAS_ALIGN 8
+
+/*
+ * タイルの一辺のセル数（2のべき乗）
+ * - 1タイルは CANVAS_TILE 行の行優先配列（1行は CANVAS_TILE * bpp / 8 バイト）
+ */
+#define CANVAS_TILE_SHIFT 6
+#define CANVAS_TILE (1 << CANVAS_TILE_SHIFT)
+#define CANVAS_TILE_MASK (CANVAS_TILE - 1)
+
+/*
+ * このセル数を超えるキャンバスはタイル方式で確保する
+ * - 大きなキャンバスでも起動時のmalloc/memsetが描いた面積分で済む
+ */
+#define CANVAS_DENSE_MAX_CELLS ((int64_t)1 << 22)
+
+/*
+ * 座標・キャンバスの一辺として受け付ける値の上限（絶対値）
+ * - 座標同士の差の積（draw_lineの補間など）がint64_tに収まる範囲
+ * - セル数（幅 x 高さ）は int64_t で扱うので 2^31 を超えてもよい
+ */
+#define COORD_MAX ((int64_t)1 << 30)
+
+/*
+ * 線の太さ（brushコマンド）の上限
+ * - 太い線の輪郭は座標を太さの半分だけずらすので、ずらした座標同士の差の積も
+ *   int64_tに収まるよう、COORD_MAXに比べて十分小さくしておく
+ */
+#define BRUSH_MAX ((int64_t)1 << 16)
+
 /*  
  * コマンドを表現する構造体（単方向リスト用）  
  * - 以前の配列による実装から線形リストによる実装に変更  
@@ -42,17 +180,303 @@ typedef struct {
 /*  
  * キャンバス操作関数のプロトタイプ宣言  
  */  
-Canvas *init_canvas(int width, int height, char pen);  // キャンバスの初期化  
+Canvas *init_canvas(int64_t width, int64_t height, char pen, const char *path);  // キャンバスの初期化  
 void reset_canvas(Canvas *c);                          // キャンバスのリセット  
 void print_canvas(Canvas *c);                          // キャンバスの表示  
 void free_canvas(Canvas *c);                          // キャンバスのメモリ解放  
+int map_canvas_file(Canvas *c, const char *path);     // キャンバスをファイルにmmap  
+int save_canvas_base(Canvas *c, const char *path);    // 再開した時点の内容を写しておく  
+
+/*
+ * 1行の格納領域に対するセル操作
+ * - bpp == 1: セルxはバイトx/8のビットx%8（下位ビットから）
+ * - bpp == 4: セルxはバイトx/2の下位4ビット（xが偶数）または上位4ビット（xが奇数）
+ * - bpp == 8: セルxはバイトx
+ */
+
+// n個のセルを格納するのに必要なバイト数
+static inline size_t cells_bytes(const int64_t n, const int bpp){
+    return ((size_t)n * bpp + 7) / 8;
+}
+
+// 行rowのcol番目のセルの格納値
+static inline unsigned cell_load(const uint8_t *row, const int64_t col, const int bpp){
+    if (bpp == 1) return (row[col >> 3] >> (col & 7)) & 1;
+    if (bpp == 4) return (row[col >> 1] >> ((col & 1) << 2)) & 0xF;
+    return row[col];
+}
+
+// 行rowのcol番目のセルに格納値vを書き込む
+static inline void cell_store(uint8_t *row, const int64_t col, const int bpp, const unsigned v){
+    if (bpp == 1){
+        const uint8_t bit = (uint8_t)(1u << (col & 7));
+        if (v) row[col >> 3] |= bit; else row[col >> 3] &= (uint8_t)~bit;
+        return;
+    }
+    if (bpp == 4){
+        const int shift = (col & 1) << 2;
+        row[col >> 1] = (uint8_t)((row[col >> 1] & ~(0xF << shift)) | (v << shift));
+        return;
+    }
+    row[col] = (uint8_t)v;
+}
+
+void cells_fill(uint8_t *row, int64_t col, const int64_t n, const int bpp, const unsigned v);  // 区間を同じ値で埋める
+
+/*
+ * セル操作関数
+ * - キャンバスのデータには必ずこれらを通してアクセスする
+ * - canvas_get / canvas_set は範囲チェックをしないので、呼び出し側で
+ *   canvas_contains を使って確認すること
+ */
+static inline int canvas_contains(const Canvas *c, const int64_t x, const int64_t y){
+    return (x >= 0) && (x < c->width) && (y >= 0) && (y < c->height);
+}
+
+uint8_t *canvas_tile_for_write(Canvas *c, const int64_t tx, const int64_t ty);  // タイルの格納値を取得（なければ確保）
+int canvas_add_pen(Canvas *c, const char ch);  // パレットへの登録（必要なら1セルのビット数を増やす）
+void canvas_recolor(Canvas *c, const char from, const char to);  // 文字の一括置き換え
+
+// タイル1行分のバイト数
+static inline size_t canvas_tile_row_bytes(const Canvas *c){
+    return cells_bytes(CANVAS_TILE, c->bpp);
+}
+
+// (x, y)を含む格納行へのポインタを返す（未確保または古いタイルならNULL）
+// - 行の中でのセルの位置は canvas_col(c, x)
+static inline uint8_t *canvas_row_at(const Canvas *c, const int64_t x, const int64_t y){
+    if (c->backend == CANVAS_TILED){
+        const Tile *tile = c->tiles[(size_t)(y >> CANVAS_TILE_SHIFT) * c->tiles_x + (x >> CANVAS_TILE_SHIFT)];
+        if (tile == NULL || tile->gen != c->gen) return NULL;  // 古いタイルは空白
+        return (uint8_t *)tile->cells + (size_t)(y & CANVAS_TILE_MASK) * canvas_tile_row_bytes(c);
+    }
+    return c->data + (size_t)y * c->stride;
+}
+
+// 書き込み用の格納行（タイルがなければ確保する、失敗したらNULL）
+static inline uint8_t *canvas_row_for_write(Canvas *c, const int64_t x, const int64_t y){
+    if (c->backend == CANVAS_TILED){
+        uint8_t *tile = canvas_tile_for_write(c, x >> CANVAS_TILE_SHIFT, y >> CANVAS_TILE_SHIFT);
+        return (tile == NULL) ? NULL : tile + (size_t)(y & CANVAS_TILE_MASK) * canvas_tile_row_bytes(c);
+    }
+    return c->data + (size_t)y * c->stride;
+}
+
+// 格納行の中でのセルxの位置
+static inline int64_t canvas_col(const Canvas *c, const int64_t x){
+    return (c->backend == CANVAS_TILED) ? (x & CANVAS_TILE_MASK) : x;
+}
+
+// 格納値 → 文字
+static inline char canvas_char_of(const Canvas *c, const unsigned v){
+    return (c->bpp == 8) ? cell_decode((uint8_t)v) : c->palette[v];
+}
+
+// 文字 → 格納値（パレットにない文字は登録する、失敗したら-1）
+static inline int canvas_value_of(Canvas *c, const char ch){
+    if (c->bpp == 8) return cell_encode(ch);
+    const uint8_t v = c->pal_index[(unsigned char)ch];
+    return (v != CANVAS_NO_INDEX) ? v : canvas_add_pen(c, ch);
+}
+
+/*
+ * 書き換わった範囲（dirty）の管理
+ * - canvas_set / canvas_hspan / canvas_vspan / canvas_fill_rect / draw_line / draw_circle /
+ *   reset_canvas / canvas_recolor が更新する
+ * - 表示や書き出しの側で canvas_get_dirty で取得し、処理し終えたら
+ *   canvas_clear_dirty で空に戻す
+ */
+
+// (x0, y0)-(x1, y1)（キャンバス内に収まっていること）を書き換わった範囲に加える
+static inline void canvas_mark_dirty(Canvas *c, const int64_t x0, const int64_t y0, const int64_t x1, const int64_t y1){
+    CanvasRect *d = &c->dirty;
+    if (x0 < d->x0) d->x0 = x0;
+    if (y0 < d->y0) d->y0 = y0;
+    if (x1 > d->x1) d->x1 = x1;
+    if (y1 > d->y1) d->y1 = y1;
+}
+
+// 書き換わった範囲をrに入れる（何も書き換わっていなければ0を返す）
+static inline int canvas_get_dirty(const Canvas *c, CanvasRect *r){
+    *r = c->dirty;
+    return c->dirty.x0 <= c->dirty.x1;
+}
+
+// 書き換わった範囲を空にする
+static inline void canvas_clear_dirty(Canvas *c){
+    c->dirty = (CanvasRect){ .x0 = c->width, .y0 = c->height, .x1 = -1, .y1 = -1 };
+}
+
+// (x, y)のセルの格納値を返す（未確保のタイルは空白）
+static inline unsigned canvas_value_at(const Canvas *c, const int64_t x, const int64_t y){
+    const uint8_t *row = canvas_row_at(c, x, y);
+    return (row == NULL) ? CELL_BLANK : cell_load(row, canvas_col(c, x), c->bpp);
+}
+
+// (x, y)のセルの文字を返す
+static inline char canvas_get(const Canvas *c, const int64_t x, const int64_t y){
+    return canvas_char_of(c, canvas_value_at(c, x, y));
+}
+
+// (x, y)のセルに文字を書き込む
+static inline void canvas_set(Canvas *c, const int64_t x, const int64_t y, const char ch){
+    // パレットへの登録で格納形式が変わることがあるので、行の取得より先に行う
+    const int v = canvas_value_of(c, ch);
+    if (v < 0) return;
+    uint8_t *row = canvas_row_for_write(c, x, y);
+    if (row != NULL) cell_store(row, canvas_col(c, x), c->bpp, (unsigned)v);
+    canvas_mark_dirty(c, x, y, x, y);
+}
+
+// (x, y)のセルに格納値vを書き込む（範囲と書き換わった範囲の更新は呼び出し側で行う）
+static inline void canvas_plot(Canvas *c, const int64_t x, const int64_t y, const unsigned v){
+    uint8_t *row = canvas_row_for_write(c, x, y);
+    if (row != NULL) cell_store(row, canvas_col(c, x), c->bpp, v);
+}
+
+void canvas_read_row(const Canvas *c, const int64_t y, const int64_t x0, const int64_t n, char *dst);  // 1行分の文字を読み出す
+void canvas_hspan(Canvas *c, int64_t x0, int64_t x1, const int64_t y, const char ch);  // 水平方向の区間を塗る
+void canvas_vspan(Canvas *c, const int64_t x, int64_t y0, int64_t y1, const char ch);  // 垂直方向の区間を塗る
+void canvas_fill_rect(Canvas *c, int64_t x0, int64_t y0, int64_t x1, int64_t y1, const char ch);  // 矩形を塗りつぶす
+void canvas_set_view(Canvas *c, int64_t x, int64_t y, int64_t w, int64_t h);  // 表示範囲の設定
+void canvas_move_view(Canvas *c, int64_t x, int64_t y);  // 表示範囲の移動
+void canvas_set_zoom(Canvas *c, int64_t zoom);  // 縮小率の設定
+void canvas_set_braille(Canvas *c, const int on);  // 点字表示の切り替え
+
+/*
+ * 表示の1セルが覆うキャンバスのセル数（横、縦）
+ * - 縮小表示では1ドットがzoom x zoomセル分
+ * - 点字表示では1セルが横2 x 縦4ドット、そうでなければ1ドット
+ */
+static inline int64_t canvas_cell_w(const Canvas *c){
+    return c->braille ? 2 * c->zoom : c->zoom;
+}
+
+static inline int64_t canvas_cell_h(const Canvas *c){
+    return c->braille ? 4 * c->zoom : c->zoom;
+}
+
+/*
+ * 縮小表示
+ * - zoom x zoomセルのうち1つでも空白以外があれば、そのセルをZOOM_INKで表示する
+ * - ZOOM_CHUNK_BYTES: 縦方向にORをとる格納行の一度に扱うバイト数
+ */
+#define ZOOM_INK '#'
+#define ZOOM_CHUNK_BYTES 4096
+void canvas_read_zoomed(const Canvas *c, const int64_t y, const int64_t x0, const int64_t n, const int64_t zoom, char *dst);  // 縮小表示の1行分を読み出す
+
+/*  
+ * 端末への出力をまとめるバッファ  
+ * - 1フレーム分（キャンバス、結果メッセージ、プロンプト）をここに組み立て、  
+ *   flush_frameで1回のwriteにまとめて出力する  
+ * - 確保した領域は次のフレームでも使い回す  
+ */  
+typedef struct {  
+    char *buf;   // 出力内容  
+    size_t len;  // 書き込み済みのバイト数  
+    size_t cap;  // 確保済みのバイト数  
+} FrameBuf;  
+
+/*  
+ * 1回に溜める出力の上限  
+ * - 巨大なキャンバスの全体出力でバッファが際限なく大きくならないよう、  
+ *   これを超える場合は途中で出力する  
+ */  
+#define FRAMEBUF_MAX ((size_t)1 << 24)  
+
+char *frame_reserve(FrameBuf *f, const size_t n);               // nバイト分の書き込み先を確保  
+void frame_append(FrameBuf *f, const char *p, const size_t n);  // バイト列の追加  
+void frame_puts(FrameBuf *f, const char *str);                   // 文字列の追加  
+void frame_csi(FrameBuf *f, const int64_t n, const char cmd);    // "\e[<n><cmd>"の追加  
+void flush_frame(FrameBuf *f);                                   // 標準出力に出力して空にする  
+
+/*  
+ * 表示範囲の内容を管理する構造体（メインスレッド側）  
+ * - キャンバスのうち表示範囲（Canvasのview）を表示上のセルに変換したものを保持する  
+ * - コマンドを実行するたびにupdate_screenで書き換わった部分だけを読み直し、  
+ *   publish_frameで描画スレッドに渡す  
+ */  
+typedef struct {  
+    int64_t x;        // 表示範囲の左上（キャンバス上の座標）  
+    int64_t y;  
+    int64_t zoom;     // 縮小率（表示の1ドットがzoom x zoomセル分）  
+    int braille;      // 1なら点字で表示する（cellsの各セルは点の並び、0が空白）  
+    int64_t width;    // 表示するセル数（横）  
+    int64_t height;   // 表示するセル数（縦）  
+    char *cells;      // 表示範囲の現在の内容（行優先、width * height文字）  
+    char *dots;       // 点字表示で1ドット行を読み出すためのバッファ（2 * width文字）  
+    int valid;        // cellsがキャンバスと一致しているか（0なら全体を読み直す）  
+} Screen;  
+
+/*  
+ * 描画スレッドに渡す1フレーム分の内容  
+ * - メインスレッドが書くback、公開済みのfront、描画スレッドが出力中のworkの  
+ *   3枚を入れ替えて使う（中身のコピーはbackへの書き込み時の1回だけ）  
+ */  
+typedef struct {  
+    int64_t width;       // 表示するセル数（横）  
+    int64_t height;      // 表示するセル数（縦）  
+    int braille;         // cellsが点の並びか  
+    char *cells;         // 表示する内容（width * height文字）  
+    size_t cap;          // cellsの確保済みバイト数  
+    long lines;          // このフレームまでに読み込んだ入力の行数  
+    const char *status;  // 結果メッセージ（NULLなら表示しない）  
+} Frame;  
+
+/*  
+ * 端末への出力を担当する描画スレッドの状態  
+ * - 上半分は描画スレッドだけが使う（端末に表示中の内容とカーソル位置）  
+ * - 下半分はlockで保護してメインスレッドとやりとりする  
+ */  
+typedef struct {  
+    int64_t width;    // 端末に表示中のフレームのセル数（横）  
+    int64_t height;   // 端末に表示中のフレームのセル数（縦）  
+    int braille;      // 表示中のフレームが点字か  
+    char blank;       // shownで空白を表す値（点字表示では0、それ以外は' '）  
+    char *shown;      // 前回端末に出力した内容（行優先、width * height文字）  
+    FrameBuf border;  // 上下の枠線（"+---+\n"を出力するバイト列）  
+    FrameBuf out;     // 出力内容を組み立てるバッファ  
+    int plain;        // 1ならセルをそのまま出力する（連続するセルを圧縮しない）  
+    int rep;          // 1なら同じ文字の繰り返し（REP、CSI n b）を使う（--rep）  
+    int valid;        // shownが端末の表示と一致しているか（0なら全体を出力し直す）  
+    int started;      // 最初のフレームを出力したか  
+    long lines;       // 前回出力したフレームまでに読み込んだ入力の行数  
+    int64_t cur_row;  // カーソルの位置（枠の左上からの行）  
+    int64_t cur_col;  // カーソルの位置（枠の左上からの列）  
+    int64_t interval;       // フレームの最短間隔（ナノ秒、0なら制限しない）  
+    struct timespec next;   // 次のフレームを出力してよい時刻（CLOCK_MONOTONIC）  
+
+    pthread_t thread;      // 描画スレッド  
+    pthread_mutex_t lock;  // front、fresh、quitを保護する  
+    pthread_cond_t cond;   // frontの更新または終了の通知  
+    Frame *back;      // メインスレッドが次に書くフレーム  
+    Frame *front;     // 公開済みの最新のフレーム  
+    Frame *work;      // 描画スレッドが出力中のフレーム  
+    int fresh;        // frontがまだ出力されていないか  
+    int quit;         // 描画スレッドを終了させるか  
+    Frame frames[3];  // back、front、workの実体  
+} Renderer;  
+
+/*  
+ * 描画するフレーム数の上限（毎秒）  
+ * - --fpsで変更できる（0なら制限しない）  
+ */  
+#define RENDER_FPS 60  
 
 /*  
  * 画面制御関数のプロトタイプ宣言  
+ * - いずれも出力はバッファに追加するだけで、flush_frameで実際に出力される  
  */  
-void rewind_screen(unsigned int line);  // 指定行数だけカーソルを上に移動  
-void clear_command(void);               // コマンド行をクリア  
-void clear_screen(void);                // 画面全体をクリア  
+void rewind_screen(FrameBuf *f, unsigned int line);  // 指定行数だけカーソルを上に移動  
+void clear_command(FrameBuf *f);        // コマンド行をクリア  
+void clear_screen(FrameBuf *f);         // 画面全体をクリア  
+Screen *init_screen(const Canvas *c);   // 表示範囲の内容の作成  
+void update_screen(Screen *s, Canvas *c);  // 表示範囲の内容をキャンバスに合わせる  
+void free_screen(Screen *s);            // 表示範囲の内容の解放  
+Renderer *start_renderer(const int plain, const int rep, const int fps);  // 描画スレッドの開始  
+void publish_frame(Renderer *r, const Screen *s, const char *status, const long lines);  // フレームを描画スレッドに渡す  
+void stop_renderer(Renderer *r);        // 描画スレッドの終了と画面のクリア  
+int input_pending(void);                // 標準入力に読み込める入力が溜まっているか  
 
 /*  
  * コマンド実行結果を表す列挙型  
@@ -62,15 +486,27 @@ typedef enum res {
     EXIT,       // 終了コマンド  
     LINE,       // 線描画コマンド  
     RECT,       // 追加：長方形描画
+    FILLRECT,   // 追加：塗りつぶした長方形の描画
     CIRCLE,     // 追加：円描画
+    FILLCIRCLE, // 追加：塗りつぶした円の描画
+    ELLIPSE,    // 追加：楕円描画
+    FILLELLIPSE,// 追加：塗りつぶした楕円の描画
+    FILL,       // 追加：領域の塗りつぶし
+    FILLPARTIAL,// 追加：領域の一部だけの塗りつぶし（メモリ不足）
+    POLYLINE,   // 追加：折れ線描画
+    POLYGON,    // 追加：多角形描画
     UNDO,       // 取り消しコマンド  
     SAVE,       // 保存コマンド  
     LOAD,       // 追加：ロードコマンド成功
     CHPEN,      // 追加：ペン文字変更
+    BRUSH,      // 追加：線の太さ変更
+    RECOLOR,    // 追加：文字の一括置き換え
+    VIEW,       // 追加：表示範囲の変更
     UNKNOWN,    // 不明なコマンド
     ERRFILE,    // 追加：ファイルエラー  
     ERRNONINT,  // 整数以外の入力エラー  
     ERRLACKARGS,// 引数不足エラー  
+    ERRRANGE,   // 追加：範囲外の数値エラー
     NOCOMMAND   // 履歴が空のエラー  
 } Result;  
 
@@ -78,9 +514,10 @@ typedef enum res {
  * その他の関数プロトタイプ宣言  
  */  
 char *strresult(Result res);  // 実行結果に対応するメッセージを返す  
-int max(const int a, const int b);  // 2つの整数の最大値を返す  
-void draw_line(Canvas *c, const int x0, const int y0, const int x1, const int y1);  // 線描画  
+void draw_line(Canvas *c, const int64_t x0, const int64_t y0, const int64_t x1, const int64_t y1);  // 線描画  
 Result interpret_command(const char *command, History *his, Canvas *c);  // コマンド解釈  
+Result read_int_args(int64_t *p, const int n);  // 整数引数の読み取り
+Result read_int_list(int64_t *p, const int max, int *n, int *fill);  // 可変個の整数引数の読み取り
 void save_history(const char *filename, History *his);  // 履歴保存  
 Command *push_command(History *his, const char *str);  // コマンドをリストに追加
 
@@ -102,34 +539,89 @@ int main(int argc, char **argv) {
      * コマンドライン引数の処理  
      * - width（幅）とheight（高さ）を取得  
      */  
-    int width;  
-    int height;  
-    if (argc != 3){  
+    int64_t width;  
+    int64_t height;  
+    
+    /*  
+     * オプションの処理  
+     * - --canvas-file <path>: キャンバスをファイルにmmapして保持する  
+     *   （同じファイルを指定して再起動すると描画内容がそのまま復元される）  
+     * - --plain: 空白や同じ文字の連続をエスケープシーケンスで圧縮せずに出力する  
+     *   （カーソル移動や繰り返しに対応していない端末やログ向け）  
+     * - --rep: 同じ文字の連続を繰り返し（REP、CSI n b）で圧縮する  
+     *   （対応はTERMからは分からず、tmuxなどはASCII以外を繰り返せないので指定した場合だけ）  
+     * - --headless: 画面への出力を一切行わず、コマンドを実行し終えてから  
+     *   キャンバス全体を1度だけ出力する（標準入出力が端末でない場合も同様）  
+     * - --fps <n>: 画面を描き直すのを毎秒n回までにする（0なら制限しない）  
+     * - オプション以外の引数は順にargs[]に集める  
+     */  
+    const char *canvas_file = NULL;  
+    int plain = 0;  
+    int rep = 0;  
+    int headless = 0;  
+    long fps = RENDER_FPS;  
+    char *args[2];  
+    int nargs = 0;  
+    for (int i = 1; i < argc; i++){  
+        if (strcmp(argv[i], "--canvas-file") == 0 && i + 1 < argc){  
+            canvas_file = argv[++i];  
+        } else if (strcmp(argv[i], "--plain") == 0){  
+            plain = 1;  
+        } else if (strcmp(argv[i], "--rep") == 0){  
+            rep = 1;  
+        } else if (strcmp(argv[i], "--headless") == 0){  
+            headless = 1;  
+        } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc){  
+            char *e;  
+            errno = 0;  
+            fps = strtol(argv[++i], &e, 10);  
+            if (*e != '\0' || errno == ERANGE || fps < 0 || fps > 1000){  
+                fprintf(stderr, "%s: fps must be between 0 and 1000\n", argv[i]);  
+                return EXIT_FAILURE;  
+            }  
+        } else if (nargs < 2){  
+            args[nargs++] = argv[i];  
+        } else {  
+            nargs++;  // 余分な引数  
+        }  
+    }  
+    
+    if (nargs != 2){  
         // 引数の数が不正な場合のエラー処理  
-        fprintf(stderr,"usage: %s <width> <height>\n",argv[0]);  
+        fprintf(stderr,"usage: %s [--canvas-file <path>] [--plain] [--rep] [--headless] [--fps <n>] <width> <height>\n",argv[0]);  
         return EXIT_FAILURE;  
     } else {  
         /*  
          * 文字列から数値への変換処理  
-         * - strtol: 文字列を長整数に変換  
+         * - strtoll: 文字列を64ビット整数に変換（longが32ビットの環境も考慮）  
          * - エラーチェック付きの変換  
          */  
         char *e;  
         // 幅の処理  
-        long w = strtol(argv[1], &e, 10);  
+        errno = 0;  
+        long long w = strtoll(args[0], &e, 10);  
         if (*e != '\0'){  // 不正な文字が含まれている場合  
-            fprintf(stderr, "%s: irregular character found %s\n", argv[1], e);  
+            fprintf(stderr, "%s: irregular character found %s\n", args[0], e);  
+            return EXIT_FAILURE;  
+        }  
+        if (errno == ERANGE || w < 1 || w > COORD_MAX){  // 範囲外の場合  
+            fprintf(stderr, "%s: width must be between 1 and %lld\n", args[0], (long long)COORD_MAX);  
             return EXIT_FAILURE;  
         }  
         // 高さの処理  
-        long h = strtol(argv[2], &e, 10);  
+        errno = 0;  
+        long long h = strtoll(args[1], &e, 10);  
         if (*e != '\0'){  // 不正な文字が含まれている場合  
-            fprintf(stderr, "%s: irregular character found %s\n", argv[2], e);  
+            fprintf(stderr, "%s: irregular character found %s\n", args[1], e);  
             return EXIT_FAILURE;  
         }  
-        // long型からint型への変換  
-        width = (int)w;  
-        height = (int)h;  
+        if (errno == ERANGE || h < 1 || h > COORD_MAX){  // 範囲外の場合  
+            fprintf(stderr, "%s: height must be between 1 and %lld\n", args[1], (long long)COORD_MAX);  
+            return EXIT_FAILURE;  
+        }  
+        // 一辺がCOORD_MAX以下なのでセル数はint64_tに収まる  
+        width = (int64_t)w;  
+        height = (int64_t)h;  
     }  
 
     /*  
@@ -141,14 +633,54 @@ int main(int argc, char **argv) {
     /*  
      * キャンバスの初期化  
      */  
-    Canvas *c = init_canvas(width, height, pen);  
+    Canvas *c = init_canvas(width, height, pen, canvas_file);  
+    if (c == NULL){  
+        fprintf(stderr, "error: cannot create %lld x %lld canvas.\n", (long long)width, (long long)height);  
+        return EXIT_FAILURE;  
+    }  
+    
+    /*  
+     * 表示範囲を端末に収まる大きさにする  
+     * - 枠の2行と、結果メッセージ・プロンプトの2行を除いた分を使う  
+     * - 端末の大きさが分からない場合は80x24とみなす  
+     * - 表示範囲はview、panコマンドで変更できる  
+     */  
+    struct winsize ws;  
+    int64_t cols = 80;  
+    int64_t rows = 24;  
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0){  
+        cols = ws.ws_col;  
+        rows = ws.ws_row;  
+    }  
+    canvas_set_view(c, 0, 0, cols - 2, rows - 4);  
     
-    printf("\n");  // Windows環境用の改行  
+    /*  
+     * 表示範囲の内容と描画スレッドの初期化  
+     * - ファイルからの入力やファイルへの出力では画面を描いても意味がないので、  
+     *   ヘッドレス（画面情報・描画スレッドなし、scr == NULL）で実行する  
+     */  
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) headless = 1;  
+    Screen *scr = NULL;  
+    Renderer *rend = NULL;  
+    if (!headless){  
+        scr = init_screen(c);  
+        rend = (scr != NULL) ? start_renderer(plain, rep, (int)fps) : NULL;  
+        if (rend == NULL){  
+            fprintf(stderr, "error: cannot start renderer.\n");  
+            if (scr != NULL) free_screen(scr);  
+            free_canvas(c);  
+            return EXIT_FAILURE;  
+        }  
+    }  
 
     // 初期ペン設定を履歴に追加
     sprintf(buf, "chpen %c\n", pen);
     if (push_command(&his, buf) == NULL){
         fprintf(stderr, "error: cannot save initial pen command.\n");
+        if (scr != NULL){
+            stop_renderer(rend);
+            free_screen(scr);
+        }
         free_canvas(c);
         return EXIT_FAILURE;
     }
@@ -157,12 +689,13 @@ int main(int argc, char **argv) {
      * メインループ  
      * - ユーザーからのコマンド入力を処理  
      */  
+    long lineno = 0;  // 入力の行番号（ヘッドレスでのエラー表示、巻き戻す行数用）  
+    if (scr != NULL){  
+        // 最初のフレーム（キャンバス全体とプロンプト）  
+        update_screen(scr, c);  
+        publish_frame(rend, scr, NULL, lineno);  
+    }  
     while(1){  
-        /*  
-         * キャンバスの表示とプロンプト出力  
-         */  
-        print_canvas(c);  
-        printf("* > ");  
 
         /*  
          * コマンド入力の受付  
@@ -170,6 +703,7 @@ int main(int argc, char **argv) {
          * - NULL: EOF（Ctrl+D）で終了  
          */  
         if(fgets(buf, bufsize, stdin) == NULL) break;  
+        lineno++;  
         
         /*  
          * コマンドの解釈と実行  
@@ -183,31 +717,48 @@ int main(int argc, char **argv) {
 
         /*  
          * コマンド実行結果の表示  
+         * - 画面への表示は次のフレームと一緒に描画スレッドが行う  
+         * - ヘッドレスではエラー（と途中までの塗りつぶし）だけを行番号付きで標準エラー出力に出す  
          */  
-        clear_command();  // 現在のコマンド行をクリア  
-        printf("%s\n", strresult(r));  // 結果メッセージの表示  
+        if (scr == NULL && (r == UNKNOWN || r == ERRFILE || r == ERRNONINT || r == ERRLACKARGS || r == ERRRANGE || r == NOCOMMAND ||
+                            r == FILLPARTIAL)){  
+            fprintf(stderr, "line %ld: %s\n", lineno, strresult(r));  
+        }  
 
         /*  
-         * 線描画コマンド、長方形描画コマンド、円描画コマンドの場合、履歴に追加  
+         * 描画コマンド、ペン変更、文字の置き換えの場合、履歴に追加  
          */  
-        if (r == LINE || r == RECT || r == CIRCLE || r == CHPEN) {  
+        if (r == LINE || r == RECT || r == FILLRECT || r == CIRCLE || r == FILLCIRCLE ||  
+            r == ELLIPSE || r == FILLELLIPSE || r == FILL || r == FILLPARTIAL || r == POLYLINE || r == POLYGON ||
+            r == CHPEN || r == BRUSH || r == RECOLOR) {  
             push_command(&his, buf);  
         }  
         
         /*  
          * 画面の再描画処理  
+         * - コマンドの実行後の表示範囲をフレームとして描画スレッドに渡す  
+         * - 次の入力がすでに届いている場合（貼り付けなど）は渡さず、  
+         *   溜まった入力を読み終えたところでまとめて1回だけ描き直す  
+         * - 描画スレッドが出力中や、フレームの間隔が空くのを待っている間に  
+         *   次のコマンドが実行された場合も、出力されるのは最新のフレームだけになる  
          */  
-        rewind_screen(2);           // コマンド結果表示部分の巻き戻し  
-        clear_command();            // コマンド自体をクリア  
-        rewind_screen(height + 2);  // キャンバス表示位置まで巻き戻し  
+        if (scr != NULL && !input_pending()){  
+            update_screen(scr, c);  
+            publish_frame(rend, scr, strresult(r), lineno);  
+        }  
     }  
     
     /*  
      * 終了処理  
-     * - 画面クリア  
+     * - 画面クリア（ヘッドレスでは最終的なキャンバス全体を出力）  
      * - キャンバスのメモリ解放  
      */  
-    clear_screen();  
+    if (scr != NULL){  
+        stop_renderer(rend);  
+        free_screen(scr);  
+    } else {  
+        print_canvas(c);  
+    }  
     free_canvas(c);  
     
     return 0;  
@@ -219,196 +770,2415 @@ int main(int argc, char **argv) {
  * - width: キャンバスの幅  
  * - height: キャンバスの高さ  
  * - pen: 描画に使用する文字  
+ * - path: キャンバスを保持するファイル（NULLならメモリ上に確保）  
+ * 戻り値：  
+ * - 確保に失敗した場合はNULL  
  */  
-Canvas *init_canvas(int width, int height, char pen)  
+Canvas *init_canvas(int64_t width, int64_t height, char pen, const char *path)  
 {  
     /*  
      * Canvas構造体のメモリ確保  
      * mallocを使用して動的にメモリを確保  
      */  
     Canvas *new = (Canvas *)malloc(sizeof(Canvas));  
+    if (new == NULL) return NULL;  
     new->width = width;  
     new->height = height;  
     
-    /*  
-     * キャンバスの2次元配列を効率的に作成  
-     * 1. まず、ポインタの配列を作成（width個）  
-     */  
-    new->canvas = (char **)malloc(width * sizeof(char *));  
+    new->stride = 0;  
+    new->data = NULL;  
+    new->tiles_x = 0;  
+    new->tiles_y = 0;  
+    new->tiles = NULL;  
+    new->gen = 0;  
+    new->fd = -1;  
+    new->map = NULL;  
+    new->map_size = 0;  
+    new->base_fd = -1;  
     
     /*  
-     * 2. 実際のデータ領域を一括で確保  
-     * - 2次元配列を1次元的に確保することで、メモリの効率化  
-     * - メモリの断片化を防ぐ  
+     * パレットの初期化  
+     * - メモリ上のキャンバスは1セル1ビット（空白とペン1種類）から始める  
+     * - ペンの種類が増えると1セル4ビット（16種類まで）、  
+     *   さらに増えると1セル8ビットに移行する（canvas_add_pen）  
      */  
-    char *tmp = (char *)malloc(width * height * sizeof(char));  
+    new->bpp = (path != NULL) ? 8 : 1;  
+    new->npalette = 1;  
+    new->palette[0] = ' ';  
+    memset(new->pal_index, CANVAS_NO_INDEX, sizeof(new->pal_index));  
+    new->pal_index[(unsigned char)' '] = 0;  
+    
+    if (path != NULL){  
+        /*  
+         * ファイル方式  
+         * - データ領域はファイルをmmapしたもの（行優先、タイルは使わない）  
+         * - RAMより大きなキャンバスでも必要なページだけが読み込まれる  
+         */  
+        new->backend = CANVAS_DENSE;  
+        new->stride = (cells_bytes(width, new->bpp) + CANVAS_ALIGN - 1) / CANVAS_ALIGN * CANVAS_ALIGN;  
+        if (map_canvas_file(new, path) != 0){  
+            free(new);  
+            return NULL;  
+        }  
+    } else if (width * height > CANVAS_DENSE_MAX_CELLS){  
+        /*  
+         * 大きなキャンバスはタイル方式にする  
+         * - ここではタイルへのポインタ配列だけを確保（全てNULL = 空白）  
+         * - タイル本体は最初に書き込まれたときに確保する  
+         */  
+        new->backend = CANVAS_TILED;  
+        new->tiles_x = (width + CANVAS_TILE - 1) >> CANVAS_TILE_SHIFT;  
+        new->tiles_y = (height + CANVAS_TILE - 1) >> CANVAS_TILE_SHIFT;  
+        new->tiles = (Tile **)calloc((size_t)new->tiles_x * new->tiles_y, sizeof(Tile *));  
+        if (new->tiles == NULL){  
+            free(new);  
+            return NULL;  
+        }  
+    } else {  
+        /*  
+         * キャンバスのデータ領域を行優先の1次元配列として一括で確保  
+         * - 1行分のバイト数（stride）はCANVAS_ALIGNの倍数に切り上げる  
+         * - 表示や水平線の描画でメモリを先頭から順に走査できる  
+         */  
+        new->backend = CANVAS_DENSE;  
+        new->stride = (cells_bytes(width, new->bpp) + CANVAS_ALIGN - 1) / CANVAS_ALIGN * CANVAS_ALIGN;  
+        /*  
+         * callocで確保した領域は0（= CELL_BLANK）で埋まっているので  
+         * 空白での初期化は不要  
+         */  
+        new->data = (uint8_t *)calloc(new->stride * height, sizeof(uint8_t));  
+        if (new->data == NULL){  
+            free(new);  
+            return NULL;  
+        }  
+    }  
     
     /*  
-     * 3. 確保した領域を空白文字で初期化  
+     * ペン文字の設定  
      */  
-    memset(tmp, ' ', width * height * sizeof(char));  
+    new->pen = pen;  
+    new->brush = 1;  
     
     /*  
-     * 4. 各行のポインタを設定  
-     * - 1次元配列を2次元的にアクセスできるように設定  
+     * 起動直後は全体を表示する必要があるので、全体を書き換わった範囲とする  
      */  
-    for (int i = 0; i < width; i++){  
-        new->canvas[i] = tmp + i * height;  
-    }  
+    canvas_clear_dirty(new);  
+    canvas_mark_dirty(new, 0, 0, width - 1, height - 1);  
     
     /*  
-     * 5. ペン文字の設定  
+     * 表示範囲はひとまず全体を等倍とする（端末の大きさに合わせるのは呼び出し側）  
      */  
-    new->pen = pen;  
+    new->zoom = 1;  
+    new->braille = 0;  
+    canvas_set_view(new, 0, 0, width, height);  
     
     return new;  
 }  
 
 /*  
- * キャンバスのリセット関数  
- * - 描画内容をすべて消去  
+ * キャンバスのデータ領域としてファイルをmmapする  
+ * - ファイルが空（新規）なら、ヘッダを書いてftruncateで必要な大きさに伸ばす  
+ *   （伸ばした部分は0 = 空白として読め、ディスクも消費しない）  
+ * - 既存のファイルなら、ヘッダのサイズが一致する場合だけそのまま使う  
+ * 戻り値：成功なら0、失敗なら-1  
  */  
-void reset_canvas(Canvas *c)  
-{  
-    const int width = c->width;  
-    const int height = c->height;  
+int map_canvas_file(Canvas *c, const char *path){  
+    const size_t data_size = c->stride * c->height;  
+    const size_t map_size = CANVAS_FILE_HEADER + data_size;  
+    
+    int fd = open(path, O_RDWR | O_CREAT, 0644);  
+    if (fd < 0){  
+        fprintf(stderr, "error: cannot open %s: %s\n", path, strerror(errno));  
+        return -1;  
+    }  
+    
+    struct stat st;  
+    if (fstat(fd, &st) != 0){  
+        fprintf(stderr, "error: cannot stat %s: %s\n", path, strerror(errno));  
+        close(fd);  
+        return -1;  
+    }  
+    
+    const CanvasFileHeader expected = {  
+        .magic = CANVAS_FILE_MAGIC,  
+        .width = c->width,  
+        .height = c->height,  
+        .stride = (int64_t)c->stride  
+    };  
+    
+    if (st.st_size == 0){  
+        // 新規ファイル：ヘッダを書いて全体の大きさを確保する  
+        if (ftruncate(fd, (off_t)map_size) != 0 ||  
+            pwrite(fd, &expected, sizeof(expected), 0) != (ssize_t)sizeof(expected)){  
+            fprintf(stderr, "error: cannot initialize %s: %s\n", path, strerror(errno));  
+            close(fd);  
+            return -1;  
+        }  
+    } else {  
+        // 既存ファイル：同じ大きさのキャンバスのものか確認する  
+        CanvasFileHeader header;  
+        if ((size_t)st.st_size != map_size ||  
+            pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||  
+            memcmp(&header, &expected, sizeof(header)) != 0){  
+            fprintf(stderr, "error: %s is not a canvas file for %lld x %lld.\n",  
+                    path, (long long)c->width, (long long)c->height);  
+            close(fd);  
+            return -1;  
+        }  
+    }  
+    
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);  
+    if (map == MAP_FAILED){  
+        fprintf(stderr, "error: cannot map %s: %s\n", path, strerror(errno));  
+        close(fd);  
+        return -1;  
+    }  
+    
+    c->fd = fd;  
+    c->map = map;  
+    c->map_size = map_size;  
+    c->data = (uint8_t *)map + CANVAS_FILE_HEADER;  
     
     /*  
-     * キャンバス全体を空白文字で上書き  
-     * - canvas[0]は実データの先頭アドレス  
+     * 既存のファイルに描かれている内容は、この実行の履歴からは作り直せない  
+     * - undoやloadで消えないよう、再開した時点の内容を写しておく（reset_canvasで書き戻す）  
+     * - 全体が穴（空白）なら写す必要はない  
      */  
-    memset(c->canvas[0], ' ', width * height * sizeof(char));  
+    if (st.st_size != 0 && !(lseek(fd, CANVAS_FILE_HEADER, SEEK_DATA) < 0 && errno == ENXIO)){  
+        if (save_canvas_base(c, path) != 0){  
+            fprintf(stderr, "error: cannot save the current state of %s: %s\n", path, strerror(errno));  
+            munmap(map, map_size);  
+            close(fd);  
+            c->fd = -1;  
+            c->map = NULL;  
+            c->data = NULL;  
+            return -1;  
+        }  
+    }  
+    return 0;  
 }  
 
 /*  
- * キャンバスの表示関数  
- * - 枠線付きでキャンバスを表示  
+ * inのoffバイト目からlenバイトのうち、データのある部分（穴以外）だけをoutの同じ位置に写す  
+ * - outの同じ範囲は穴（0 = 空白）にしておくこと  
+ * - copy_file_rangeが使えないファイルシステムではpread / pwriteで写す  
+ * 戻り値：成功なら0、失敗なら-1  
  */  
-void print_canvas(Canvas *c)  
+static int copy_file_data(const int in, const int out, const off_t off, const off_t len){  
+    const off_t end = off + len;  
+    off_t pos = off;  
+    while (pos < end){  
+        off_t src = lseek(in, pos, SEEK_DATA);  
+        if (src < 0) return (errno == ENXIO) ? 0 : -1;  // この先はすべて穴  
+        if (src >= end) return 0;  
+        off_t hole = lseek(in, src, SEEK_HOLE);  
+        if (hole < 0) return -1;  
+        if (hole > end) hole = end;  
+        
+        while (src < hole){  
+            off_t dst = src;  
+            ssize_t n = copy_file_range(in, &src, out, &dst, (size_t)(hole - src), 0);  
+            if (n <= 0){  
+                char buf[65536];  
+                const size_t want = (hole - src < (off_t)sizeof(buf)) ? (size_t)(hole - src) : sizeof(buf);  
+                n = pread(in, buf, want, src);  
+                if (n <= 0 || pwrite(out, buf, (size_t)n, src) != n) return -1;  
+                src += n;  
+            }  
+        }  
+        pos = hole;  
+    }  
+    return 0;  
+}  
+
+/*  
+ * ファイル方式のキャンバスの現在の内容を、同じディレクトリの名前のない一時ファイルに写す  
+ * - 同じファイルシステムなのでcopy_file_rangeが領域の共有（reflink）で済むことがあり、  
+ *   RAMより大きなキャンバスでもメモリを使わない  
+ * - 穴は穴のまま写すので、描かれている部分の分だけディスクを使う  
+ * 戻り値：成功なら0、失敗なら-1  
+ */  
+int save_canvas_base(Canvas *c, const char *path){  
+    const char *slash = strrchr(path, '/');  
+    const size_t dirlen = (slash != NULL) ? (size_t)(slash - path) + 1 : 0;  
+    char tmpl[dirlen + sizeof(".paint-base-XXXXXX")];  
+    memcpy(tmpl, path, dirlen);  
+    strcpy(tmpl + dirlen, ".paint-base-XXXXXX");  
+    
+    const int fd = mkstemp(tmpl);  
+    if (fd < 0) return -1;  
+    unlink(tmpl);  // 閉じたら消えるようにする  
+    
+    if (ftruncate(fd, (off_t)c->map_size) != 0 ||  
+        copy_file_data(c->fd, fd, CANVAS_FILE_HEADER, (off_t)(c->stride * c->height)) != 0){  
+        const int e = errno;  
+        close(fd);  
+        errno = e;  
+        return -1;  
+    }  
+    c->base_fd = fd;  
+    return 0;  
+}  
+
+/*  
+ * キャンバスのリセット関数  
+ * - 描画内容をすべて消去  
+ */  
+void reset_canvas(Canvas *c)  
 {  
-    const int height = c->height;  
-    const int width = c->width;  
-    char **canvas = c->canvas;  
+    const int64_t height = c->height;  
     
     /*  
-     * 上部の枠線を描画  
-     * 例：width=3の場合  
-     * +---+  
+     * 全セルが空白になるので、パレットも空白だけに戻す  
+     * - 1セルの大きさ（bpp）はそのまま  
      */  
-    printf("+");  
-    for (int x = 0; x < width; x++)  
-        printf("-");  
-    printf("+\n");  
+    for (int i = 1; i < c->npalette; i++){  
+        c->pal_index[(unsigned char)c->palette[i]] = CANVAS_NO_INDEX;  
+    }  
+    c->npalette = 1;  
+    
+    canvas_mark_dirty(c, 0, 0, c->width - 1, height - 1);  
     
     /*  
-     * キャンバスの内容を1行ずつ表示  
-     * - 左右に'|'を付けて表示  
-     * 例：  
-     * |   |  
-     * | * |  
-     * |   |  
+     * タイル方式では世代を1つ進めるだけでよい（O(1)）  
+     * - 既存のタイルはすべて古い世代になり、空白として読まれる  
+     * - タイルのメモリは解放せず、次に書き込まれたときに消去して使い回す  
+     *   （undoで同じ範囲を描き直すときにmalloc/freeを繰り返さない）  
+     * - 世代が一周した場合だけ、古い世代と区別できるよう全タイルを解放する  
      */  
-    for (int y = 0; y < height; y++) {  
-        printf("|");  
-        for (int x = 0; x < width; x++){  
-            const char c = canvas[x][y];  
-            putchar(c);  
+    if (c->backend == CANVAS_TILED){  
+        if (++c->gen == 0){  
+            const size_t ntiles = (size_t)c->tiles_x * c->tiles_y;  
+            for (size_t i = 0; i < ntiles; i++){  
+                free(c->tiles[i]);  
+                c->tiles[i] = NULL;  
+            }  
         }  
-        printf("|\n");  
+        return;  
     }  
     
     /*  
-     * 下部の枠線を描画  
+     * ファイル方式ではデータ部分に穴をあける  
+     * - 穴の部分は0（= 空白）として読まれ、ディスクの領域も解放される  
+     * - ファイルシステムが対応していない場合はmemsetで消去する  
      */  
-    printf("+");  
-    for (int x = 0; x < width; x++)  
-        printf("-");  
-    printf("+\n");  
+    int blank = 0;  
+#ifdef FALLOC_FL_PUNCH_HOLE  
+    blank = (c->fd >= 0 &&  
+             fallocate(c->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,  
+                       CANVAS_FILE_HEADER, (off_t)(c->stride * height)) == 0);  
+#endif  
     
     /*  
-     * バッファの内容を確実に出力  
+     * キャンバス全体を空白で上書き  
+     * - 行末のパディングも含めて連続した領域なので1回のmemsetで済む  
+     * - 1セル1ビットなら8分の1の量で済む  
      */  
-    fflush(stdout);  
+    if (!blank){  
+        memset(c->data, CELL_BLANK, c->stride * height);  
+    }  
+    
+    /*  
+     * 既存のファイルから再開した場合は、再開した時点の内容に戻す  
+     * - 履歴はこの実行の分しかないので、空白ではなくこの内容から描き直す  
+     */  
+    if (c->base_fd >= 0 &&  
+        copy_file_data(c->base_fd, c->fd, CANVAS_FILE_HEADER, (off_t)(c->stride * height)) != 0){  
+        fprintf(stderr, "error: cannot restore the canvas file: %s\n", strerror(errno));  
+    }  
 }  
 
 /*  
- * キャンバスのメモリ解放関数  
- * - メモリリークを防ぐため、確保したメモリを適切に解放  
+ * (tx, ty)番目のタイルの格納値を書き込み用に返す  
+ * - 未確保なら確保して空白で初期化する  
+ * - 古い世代のタイルなら空白で消去して現在の世代にする  
+ * - 確保に失敗した場合はNULL  
  */  
-void free_canvas(Canvas *c)  
-{  
-    /*  
-     * メモリ解放の順序が重要  
-     * 1. まず実データ領域を解放（canvas[0]が先頭アドレス）  
-     * 2. 次にポインタ配列を解放  
-     * 3. 最後にCanvas構造体自体を解放  
-     */  
-    free(c->canvas[0]);  // 実データの解放  
-    free(c->canvas);     // ポインタ配列の解放  
-    free(c);             // 構造体の解放  
-}
+uint8_t *canvas_tile_for_write(Canvas *c, const int64_t tx, const int64_t ty){  
+    Tile **slot = &c->tiles[(size_t)ty * c->tiles_x + tx];  
+    const size_t bytes = CANVAS_TILE * canvas_tile_row_bytes(c);  
+    if (*slot == NULL){  
+        Tile *tile = (Tile *)calloc(1, sizeof(Tile) + bytes);  // 0 = 空白  
+        if (tile == NULL){  
+            fprintf(stderr, "error: memory allocation failed.\n");  
+            return NULL;  
+        }  
+        tile->gen = c->gen;  
+        *slot = tile;  
+    } else if ((*slot)->gen != c->gen){  
+        memset((*slot)->cells, CELL_BLANK, bytes);  
+        (*slot)->gen = c->gen;  
+    }  
+    return (*slot)->cells;  
+}  
 
-void rewind_screen(unsigned int line)
-{
-    printf("\e[%dA",line);
-}
+/*  
+ * 行rowのcol番目から始まるn個のセルを格納値vで埋める  
+ * - bpp == 8 ならmemsetで一度に書く  
+ * - bpp == 1, 4 なら端数のセルだけを1つずつ書き、  
+ *   バイト境界に揃った中央部分はvを並べたバイトのmemsetでワード単位に書く  
+ */  
+void cells_fill(uint8_t *row, int64_t col, const int64_t n, const int bpp, const unsigned v){  
+    if (bpp == 8){  
+        memset(row + col, (int)v, (size_t)n);  
+        return;  
+    }  
+    
+    const int per_byte = 8 / bpp;  // 1バイトに入るセル数  
+    const uint8_t pattern = (bpp == 1) ? (v ? 0xFF : 0x00) : (uint8_t)(v | (v << 4));  
+    const int64_t end = col + n;  
+    while (col < end && (col % per_byte) != 0){  
+        cell_store(row, col++, bpp, v);  
+    }  
+    const int64_t nbytes = (end - col) / per_byte;  
+    memset(row + col / per_byte, pattern, (size_t)nbytes);  
+    col += nbytes * per_byte;  
+    while (col < end){  
+        cell_store(row, col++, bpp, v);  
+    }  
+}  
 
-void clear_command(void)
-{
-    printf("\e[2K");
-}
+/*  
+ * キャンバスの1セルのビット数をbppに変更する  
+ * - 既存のセルは格納値をmap[]で変換して詰め直す  
+ * - 戻り値：成功なら0、メモリ確保に失敗したら-1（キャンバスは元のまま）  
+ */  
+static int canvas_repack(Canvas *c, const int bpp, const uint8_t map[256]){  
+    const int old_bpp = c->bpp;  
+    
+    if (c->backend == CANVAS_TILED){  
+        const size_t ntiles = (size_t)c->tiles_x * c->tiles_y;  
+        const size_t old_row = cells_bytes(CANVAS_TILE, old_bpp);  
+        const size_t new_row = cells_bytes(CANVAS_TILE, bpp);  
+        
+        // 古い世代のタイルは中身が不要なので先に解放する  
+        for (size_t i = 0; i < ntiles; i++){  
+            if (c->tiles[i] != NULL && c->tiles[i]->gen != c->gen){  
+                free(c->tiles[i]);  
+                c->tiles[i] = NULL;  
+            }  
+        }  
+        
+        // 途中で失敗しても元に戻せるよう、先に全タイル分を確保する  
+        Tile **repacked = (Tile **)calloc(ntiles, sizeof(Tile *));  
+        if (repacked == NULL) return -1;  
+        for (size_t i = 0; i < ntiles; i++){  
+            if (c->tiles[i] == NULL) continue;  
+            repacked[i] = (Tile *)calloc(1, sizeof(Tile) + CANVAS_TILE * new_row);  
+            if (repacked[i] == NULL){  
+                for (size_t j = 0; j < i; j++) free(repacked[j]);  
+                free(repacked);  
+                return -1;  
+            }  
+            repacked[i]->gen = c->gen;  
+        }  
+        for (size_t i = 0; i < ntiles; i++){  
+            if (c->tiles[i] == NULL) continue;  
+            for (int r = 0; r < CANVAS_TILE; r++){  
+                const uint8_t *src = c->tiles[i]->cells + r * old_row;  
+                uint8_t *dst = repacked[i]->cells + r * new_row;  
+                for (int col = 0; col < CANVAS_TILE; col++){  
+                    cell_store(dst, col, bpp, map[cell_load(src, col, old_bpp)]);  
+                }  
+            }  
+            free(c->tiles[i]);  
+            c->tiles[i] = repacked[i];  
+        }  
+        free(repacked);  
+    } else {  
+        const size_t stride = (cells_bytes(c->width, bpp) + CANVAS_ALIGN - 1) / CANVAS_ALIGN * CANVAS_ALIGN;  
+        uint8_t *data = (uint8_t *)calloc(stride * c->height, sizeof(uint8_t));  
+        if (data == NULL) return -1;  
+        for (int64_t y = 0; y < c->height; y++){  
+            const uint8_t *src = c->data + (size_t)y * c->stride;  
+            uint8_t *dst = data + (size_t)y * stride;  
+            for (int64_t x = 0; x < c->width; x++){  
+                cell_store(dst, x, bpp, map[cell_load(src, x, old_bpp)]);  
+            }  
+        }  
+        free(c->data);  
+        c->data = data;  
+        c->stride = stride;  
+    }  
+    
+    c->bpp = bpp;  
+    return 0;  
+}  
 
-void clear_screen(void)
-{
-    printf( "\e[2J");
-}
+/*  
+ * パレットにない文字chを登録し、その格納値を返す  
+ * - パレットに空きがあればそのまま追加する  
+ * - 1セル1ビットで空きがなければ1セル4ビットに移行する（番号はそのまま）  
+ * - 1セル4ビットで空きがなければ1セル8ビット（文字そのもの）に移行する  
+ * - 失敗した場合は-1  
+ */  
+int canvas_add_pen(Canvas *c, const char ch){  
+    uint8_t map[256];  // 移行時の格納値の変換表  
+    
+    if (c->npalette >= (1 << c->bpp) && c->bpp == 1){  
+        for (int i = 0; i < 256; i++) map[i] = (uint8_t)i;  
+        if (canvas_repack(c, 4, map) != 0){  
+            fprintf(stderr, "error: memory allocation failed.\n");  
+            return -1;  
+        }  
+    }  
+    
+    if (c->npalette < (1 << c->bpp)){  
+        const int v = c->npalette++;  
+        c->palette[v] = ch;  
+        c->pal_index[(unsigned char)ch] = (uint8_t)v;  
+        return v;  
+    }  
+    
+    // パレット番号 → 文字（の格納値）への変換表  
+    memset(map, 0, sizeof(map));  
+    for (int i = 0; i < c->npalette; i++){  
+        map[i] = cell_encode(c->palette[i]);  
+    }  
+    if (canvas_repack(c, 8, map) != 0){  
+        fprintf(stderr, "error: memory allocation failed.\n");  
+        return -1;  
+    }  
+    return cell_encode(ch);  
+}  
 
+/*  
+ * 全セルの格納値をmap[]で変換する（1セルのビット数はそのまま、その場で書き換える）  
+ * - タイル方式では古い世代のタイルは空白として読まれるので触れない  
+ */  
+static void canvas_remap(Canvas *c, const uint8_t map[256]){  
+    if (c->backend == CANVAS_TILED){  
+        const size_t ntiles = (size_t)c->tiles_x * c->tiles_y;  
+        const size_t row_bytes = canvas_tile_row_bytes(c);  
+        for (size_t i = 0; i < ntiles; i++){  
+            if (c->tiles[i] == NULL || c->tiles[i]->gen != c->gen) continue;  
+            for (int r = 0; r < CANVAS_TILE; r++){  
+                uint8_t *row = c->tiles[i]->cells + r * row_bytes;  
+                for (int col = 0; col < CANVAS_TILE; col++){  
+                    cell_store(row, col, c->bpp, map[cell_load(row, col, c->bpp)]);  
+                }  
+            }  
+        }  
+        return;  
+    }  
+    for (int64_t y = 0; y < c->height; y++){  
+        uint8_t *row = c->data + (size_t)y * c->stride;  
+        for (int64_t x = 0; x < c->width; x++){  
+            cell_store(row, x, c->bpp, map[cell_load(row, x, c->bpp)]);  
+        }  
+    }  
+}  
 
-int max(const int a, const int b)
-{
-    return (a > b) ? a : b;
-}
-void draw_line(Canvas *c, const int x0, const int y0, const int x1, const int y1)
-{
-    const int width = c->width;
-    const int height = c->height;
-    char pen = c->pen;
+/*  
+ * キャンバス上の文字fromをすべて文字toに置き換える  
+ * - パレットを使っている間（bpp < 8）は表の書き換えだけで済み、セルには触れない  
+ *   - toが既に登録済みなら、fromの番号のセルをtoの番号に書き換えて1つにまとめる  
+ *     （同じ文字に番号が2つあると、その後のrecolorやfillで別の文字として扱われる）  
+ *   - 空いた番号にはパレットの最後の文字を移し、パレットを詰めておく  
+ * - 1セル8ビットの場合は全セルを走査して置き換える  
+ */  
+void canvas_recolor(Canvas *c, const char from, const char to){  
+    if (from == to) return;  
     
-    const int n = max(abs(x1 - x0), abs(y1 - y0));
-    if ( (x0 >= 0) && (x0 < width) && (y0 >= 0) && (y0 < height))
-	c->canvas[x0][y0] = pen;
-    for (int i = 1; i <= n; i++) {
-	const int x = x0 + i * (x1 - x0) / n;
-	const int y = y0 + i * (y1 - y0) / n;
-	if ( (x >= 0) && (x< width) && (y >= 0) && (y < height))
-	    c->canvas[x][y] = pen;
-    }
-}
+    // どこにあるかは分からないので全体を書き換わった範囲とする  
+    canvas_mark_dirty(c, 0, 0, c->width - 1, c->height - 1);  
+    
+    if (c->bpp < 8){  
+        const uint8_t v = c->pal_index[(unsigned char)from];  
+        if (v == CANVAS_NO_INDEX || v == 0) return;  // 使われていない（または空白）  
+        
+        const uint8_t w = c->pal_index[(unsigned char)to];  
+        c->pal_index[(unsigned char)from] = CANVAS_NO_INDEX;  
+        if (w == CANVAS_NO_INDEX){  
+            c->palette[v] = to;  
+            c->pal_index[(unsigned char)to] = v;  
+            return;  
+        }  
+        
+        // fromの番号vをtoの番号wにまとめ、最後の番号lastをvに移す  
+        const int last = c->npalette - 1;  
+        uint8_t map[256];  
+        for (int i = 0; i < 256; i++) map[i] = (uint8_t)i;  
+        map[last] = v;  
+        map[v] = (w == last) ? v : w;  
+        canvas_remap(c, map);  
+        if (v != last){  
+            c->palette[v] = c->palette[last];  
+            c->pal_index[(unsigned char)c->palette[v]] = v;  
+        }  
+        c->npalette--;  
+        return;  
+    }  
+    
+    const uint8_t vf = cell_encode(from);  
+    const uint8_t vt = cell_encode(to);  
+    if (c->backend == CANVAS_TILED){  
+        const size_t ntiles = (size_t)c->tiles_x * c->tiles_y;  
+        const size_t tile_bytes = CANVAS_TILE * canvas_tile_row_bytes(c);  
+        for (size_t i = 0; i < ntiles; i++){  
+            if (c->tiles[i] == NULL || c->tiles[i]->gen != c->gen) continue;  
+            uint8_t *cells = c->tiles[i]->cells;  
+            for (size_t k = 0; k < tile_bytes; k++){  
+                if (cells[k] == vf) cells[k] = vt;  
+            }  
+        }  
+        return;  
+    }  
+    for (int64_t y = 0; y < c->height; y++){  
+        uint8_t *row = c->data + (size_t)y * c->stride;  
+        for (int64_t x = 0; x < c->width; x++){  
+            if (row[x] == vf) row[x] = vt;  
+        }  
+    }  
+}  
 
-void draw_rect(Canvas *c, const int x0, const int y0, const int width, const int height){
+/*  
+ * 格納行rowのcol番目から始まるn個のセルを文字に展開してdstに書く  
+ */  
+static void cells_expand(const Canvas *c, char *dst, const uint8_t *row, int64_t col, const int64_t n){  
+    if (c->bpp == 8){  
+        for (int64_t i = 0; i < n; i++){  
+            dst[i] = cell_decode(row[col + i]);  
+        }  
+        return;  
+    }  
+    
+    for (int64_t i = 0; i < n; i++, col++){  
+        dst[i] = c->palette[cell_load(row, col, c->bpp)];  
+    }  
+}  
+
+/*  
+ * y行目のx0から始まるn個のセルの文字をdstにコピーする  
+ * - タイル方式ではタイルごとに連続した部分をまとめてコピーする  
+ */  
+void canvas_read_row(const Canvas *c, const int64_t y, const int64_t x0, const int64_t n, char *dst){  
+    if (c->backend == CANVAS_DENSE){  
+        cells_expand(c, dst, c->data + (size_t)y * c->stride, x0, n);  
+        return;  
+    }  
+    
+    int64_t x = x0;  
+    const int64_t end = x0 + n;  
+    while (x < end){  
+        const int64_t tile_end = (x | CANVAS_TILE_MASK) + 1;  // このタイルの右端の次  
+        const int64_t len = ((tile_end < end) ? tile_end : end) - x;  
+        const uint8_t *row = canvas_row_at(c, x, y);  
+        if (row == NULL){  
+            memset(dst, ' ', len);  
+        } else {  
+            cells_expand(c, dst, row, canvas_col(c, x), len);  
+        }  
+        dst += len;  
+        x += len;  
+    }  
+}  
+
+/*
+ * 縮小表示用に、1行分のセルの格納値をまとめてORする
+ * - 8バイトずつ（memcpyで境界を気にせず）読み書きし、端数はバイト単位で行う
+ */
+static void bytes_or(uint8_t *dst, const uint8_t *src, const size_t n){
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8){
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a |= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < n; i++){
+        dst[i] |= src[i];
+    }
+}
+
+/*
+ * 格納行rowの[a, b)番目のセルに空白（格納値0）以外があるか
+ * - 端数のセルは1つずつ、間のバイトは8バイトずつまとめて調べる
+ */
+static int cells_any(const uint8_t *row, int64_t a, const int64_t b, const int bpp){
+    const int per_byte = 8 / bpp;  // 1バイトに入るセル数
+    while (a < b && (a % per_byte) != 0){
+        if (cell_load(row, a++, bpp)) return 1;
+    }
+    size_t i = (size_t)(a / per_byte);
+    const size_t end = (size_t)(b / per_byte);
+    for (; i + 8 <= end; i += 8){
+        uint64_t w;
+        memcpy(&w, row + i, 8);
+        if (w) return 1;
+    }
+    for (; i < end; i++){
+        if (row[i]) return 1;
+    }
+    // 範囲が1バイトに収まる場合は、先頭のループでaがbに達している（aより左は調べない）
+    if (a < (int64_t)end * per_byte) a = (int64_t)end * per_byte;
+    for (; a < b; a++){
+        if (cell_load(row, a, bpp)) return 1;
+    }
+    return 0;
+}
+
+/*
+ * 縮小表示の1行分を読み出す
+ * - 出力のj番目のセルは、x0 + j * zoom から横zoomセル、yから縦zoomセルの範囲
+ *   （キャンバスの外は除く）をまとめたもの
+ * - その範囲に空白以外のセルが1つでもあればZOOM_INK、なければ空白にする
+ * - 空白の格納値はどのbppでも0なので、縦に並ぶ格納行を格納値のまま
+ *   ORしてから（bytes_or）、横の範囲ごとに0以外があるかを調べる（cells_any）
+ * - ORする行の長さは ZOOM_CHUNK_BYTES ずつに区切る
+ */
+void canvas_read_zoomed(const Canvas *c, const int64_t y, const int64_t x0, const int64_t n, const int64_t zoom, char *dst){
+    uint8_t acc[ZOOM_CHUNK_BYTES];
+    const int bpp = c->bpp;
+    const int per_byte = 8 / bpp;
+    const int64_t y_end = (y + zoom < c->height) ? y + zoom : c->height;
+    const int64_t x_end = (x0 + n * zoom < c->width) ? x0 + n * zoom : c->width;
+
+    memset(dst, ' ', (size_t)n);
+    int64_t x = x0;
+    while (x < x_end){
+        // accの先頭は格納行のバイト境界に揃える
+        const int64_t base = x - x % per_byte;
+        const int64_t next = (base + (int64_t)ZOOM_CHUNK_BYTES * per_byte < x_end) ? base + (int64_t)ZOOM_CHUNK_BYTES * per_byte : x_end;
+        memset(acc, 0, cells_bytes(next - base, bpp));
+
+        for (int64_t yy = y; yy < y_end; yy++){
+            int64_t sx = base;
+            while (sx < next){
+                // タイル方式ではタイルの境界で区切る（タイルの左端はバイト境界）
+                int64_t seg_end = next;
+                if (c->backend == CANVAS_TILED && ((sx | CANVAS_TILE_MASK) + 1) < seg_end){
+                    seg_end = (sx | CANVAS_TILE_MASK) + 1;
+                }
+                const uint8_t *row = canvas_row_at(c, sx, yy);
+                if (row != NULL){
+                    bytes_or(acc + (sx - base) / per_byte, row + canvas_col(c, sx) / per_byte, cells_bytes(seg_end - sx, bpp));
+                }
+                sx = seg_end;
+            }
+        }
+
+        // [x, next)に掛かる出力セルごとに調べる
+        for (int64_t j = (x - x0) / zoom; j < n && x0 + j * zoom < next; j++){
+            if (dst[j] != ' ') continue;
+            const int64_t a = (x0 + j * zoom > x) ? x0 + j * zoom : x;
+            const int64_t b = (x0 + (j + 1) * zoom < next) ? x0 + (j + 1) * zoom : next;
+            if (cells_any(acc, a - base, b - base, bpp)) dst[j] = ZOOM_INK;
+        }
+        x = next;
+    }
+}
+
+/*
+ * 表示範囲の左上を(x, y)にする
+ * - 大きさは表示するセル数（view_cols x view_rows）に1セルが覆うセル数を
+ *   掛けたもので、キャンバスに収まるように丸める
+ * - 位置は表示範囲がキャンバスからはみ出さないようにずらす
+ */
+void canvas_move_view(Canvas *c, int64_t x, int64_t y){
+    int64_t w = c->view_cols * canvas_cell_w(c);
+    int64_t h = c->view_rows * canvas_cell_h(c);
+    if (w > c->width) w = c->width;
+    if (h > c->height) h = c->height;
+    if (x > c->width - w) x = c->width - w;
+    if (y > c->height - h) y = c->height - h;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    c->view = (CanvasRect){ .x0 = x, .y0 = y, .x1 = x + w - 1, .y1 = y + h - 1 };
+}
+
+/*
+ * 表示範囲を左上(x, y)、幅w、高さh（キャンバス上のセル数）に設定する
+ * - 縮小表示や点字表示では、表示するセル数はwとhを1セルが覆うセル数で
+ *   割ったもの（切り上げ）になる
+ */
+void canvas_set_view(Canvas *c, int64_t x, int64_t y, int64_t w, int64_t h){
+    if (w < 1) w = 1;
+    if (h < 1) h = 1;
+    c->view_cols = (w + canvas_cell_w(c) - 1) / canvas_cell_w(c);
+    c->view_rows = (h + canvas_cell_h(c) - 1) / canvas_cell_h(c);
+    canvas_move_view(c, x, y);
+}
+
+/*
+ * 縮小率をzoom（zoom x zoomセルを1セルに表示）にする
+ * - 表示するセル数と左上の位置はそのままにする
+ */
+void canvas_set_zoom(Canvas *c, int64_t zoom){
+    c->zoom = (zoom < 1) ? 1 : zoom;
+    canvas_move_view(c, c->view.x0, c->view.y0);
+}
+
+/*
+ * 点字表示を切り替える
+ * - 縮小率と同じく、表示するセル数と左上の位置はそのままにする
+ */
+void canvas_set_braille(Canvas *c, const int on){
+    c->braille = on;
+    canvas_move_view(c, c->view.x0, c->view.y0);
+}
+
+/*  
+ * 上下の枠線（"+---+\n"、width + 3文字）をpに書き込む  
+ */  
+static void fill_border(char *p, const int64_t width)  
+{  
+    p[0] = '+';  
+    memset(p + 1, '-', (size_t)width);  
+    p[width + 1] = '+';  
+    p[width + 2] = '\n';  
+}  
+
+/*  
+ * キャンバスの表示関数  
+ * - 枠線付きでキャンバスを表示  
+ * - 全体をバッファに組み立ててから出力する  
+ */  
+void print_canvas(Canvas *c)  
+{  
+    const int64_t height = c->height;  
+    const int64_t width = c->width;  
+    FrameBuf f = { .buf = NULL, .len = 0, .cap = 0 };  
+    char *p;  
+    
+    /*  
+     * 上部の枠線を描画  
+     * 例：width=3の場合  
+     * +---+  
+     */  
+    if ((p = frame_reserve(&f, (size_t)width + 3)) != NULL) fill_border(p, width);  
+    
+    /*  
+     * キャンバスの内容を1行ずつ表示  
+     * - 左右に'|'を付けて表示  
+     * - 行の内容はバッファに直接読み出す  
+     * 例：  
+     * |   |  
+     * | * |  
+     * |   |  
+     */  
+    for (int64_t y = 0; y < height; y++) {  
+        if ((p = frame_reserve(&f, (size_t)width + 3)) == NULL) continue;  
+        p[0] = '|';  
+        canvas_read_row(c, y, 0, width, p + 1);  
+        p[width + 1] = '|';  
+        p[width + 2] = '\n';  
+    }  
+    
+    /*  
+     * 下部の枠線を描画  
+     */  
+    if ((p = frame_reserve(&f, (size_t)width + 3)) != NULL) fill_border(p, width);  
+    
+    /*  
+     * 全体を表示したので、書き換わった範囲は空に戻す  
+     */  
+    canvas_clear_dirty(c);  
+    
+    /*  
+     * バッファの内容を出力  
+     */  
+    flush_frame(&f);  
+    free(f.buf);  
+}  
+
+/*  
+ * キャンバスのメモリ解放関数  
+ * - メモリリークを防ぐため、確保したメモリを適切に解放  
+ */  
+void free_canvas(Canvas *c)  
+{  
+    /*  
+     * メモリ解放の順序が重要  
+     * 1. まず実データ領域（タイル方式では各タイルとポインタ配列）を解放  
+     *    ファイル方式では内容をファイルに書き戻してからmunmapする  
+     * 2. 最後にCanvas構造体自体を解放  
+     */  
+    if (c->backend == CANVAS_TILED){  
+        const size_t ntiles = (size_t)c->tiles_x * c->tiles_y;  
+        for (size_t i = 0; i < ntiles; i++){  
+            free(c->tiles[i]);  // 各タイルの解放  
+        }  
+        free(c->tiles);  // ポインタ配列の解放  
+    }  
+    if (c->fd >= 0){  
+        msync(c->map, c->map_size, MS_SYNC);  
+        munmap(c->map, c->map_size);  
+        close(c->fd);  
+        if (c->base_fd >= 0) close(c->base_fd);  
+    } else {  
+        free(c->data);  // 実データの解放  
+    }  
+    free(c);        // 構造体の解放  
+}
+
+/*
+ * 出力バッファの末尾にnバイト分の書き込み先を確保し、その先頭を返す
+ * - 足りない場合は倍々に拡張する
+ * - 溜まった量がFRAMEBUF_MAXを超える場合や拡張に失敗した場合は、
+ *   先にそれまでの内容を出力してから確保し直す
+ * - それでも確保できない場合はNULLを返す（その分の出力は捨てる）
+ */
+char *frame_reserve(FrameBuf *f, const size_t n)
+{
+    if (f->len + n > f->cap){
+        if (f->len > 0 && f->len + n > FRAMEBUF_MAX) flush_frame(f);
+        size_t cap = (f->cap > 0) ? f->cap : 4096;
+        while (cap < f->len + n) cap *= 2;
+        char *buf = (cap > f->cap) ? (char *)realloc(f->buf, cap) : f->buf;
+        if (buf == NULL){
+            flush_frame(f);
+            if (n > f->cap) return NULL;
+        } else {
+            f->buf = buf;
+            f->cap = cap;
+        }
+    }
+    char *p = f->buf + f->len;
+    f->len += n;
+    return p;
+}
+
+void frame_append(FrameBuf *f, const char *p, const size_t n)
+{
+    char *dst = frame_reserve(f, n);
+    if (dst != NULL) memcpy(dst, p, n);
+}
+
+void frame_puts(FrameBuf *f, const char *str)
+{
+    frame_append(f, str, strlen(str));
+}
+
+/*
+ * エスケープシーケンス"\e[<n><cmd>"を追加する
+ * - printfを使わずに数字を組み立てる
+ */
+void frame_csi(FrameBuf *f, const int64_t n, const char cmd)
+{
+    char tmp[32];
+    int i = (int)sizeof(tmp);
+    tmp[--i] = cmd;
+    uint64_t m = (uint64_t)n;
+    do {
+        tmp[--i] = (char)('0' + m % 10);
+        m /= 10;
+    } while (m > 0);
+    tmp[--i] = '[';
+    tmp[--i] = '\e';
+    frame_append(f, tmp + i, sizeof(tmp) - i);
+}
+
+/*
+ * 溜めた内容を標準出力に書き出して空にする
+ * - 途中までしか書けなかった場合やシグナルで中断された場合は続きを書く
+ */
+void flush_frame(FrameBuf *f)
+{
+    size_t done = 0;
+    while (done < f->len){
+        const ssize_t w = write(STDOUT_FILENO, f->buf + done, f->len - done);
+        if (w < 0){
+            if (errno == EINTR) continue;
+            break;  // 出力できない場合は残りを捨てる
+        }
+        done += (size_t)w;
+    }
+    f->len = 0;
+}
+
+void rewind_screen(FrameBuf *f, unsigned int line)
+{
+    frame_csi(f, line, 'A');
+}
+
+void clear_command(FrameBuf *f)
+{
+    frame_puts(f, "\e[2K");
+}
+
+void clear_screen(FrameBuf *f)
+{
+    frame_puts(f, "\e[2J");
+}
+
+/*
+ * 表示範囲の内容（メインスレッド側）
+ * - キャンバスの表示範囲を表示上のセルに変換してcellsに保持する
+ * - 端末への出力は行わない（描画スレッドの担当）
+ */
+
+// キャンバスの表示範囲を表示するのに必要なセル数
+static int64_t screen_cols(const Canvas *c){
+    return (c->view.x1 - c->view.x0 + canvas_cell_w(c)) / canvas_cell_w(c);
+}
+
+static int64_t screen_rows(const Canvas *c){
+    return (c->view.y1 - c->view.y0 + canvas_cell_h(c)) / canvas_cell_h(c);
+}
+
+/*
+ * 点字（U+2800〜U+28FF）の表
+ * - braille_pair[r][b]: 点字1文字の上からr行目の2ドット（bのビット0が左、
+ *   ビット1が右）に対応する点のビット
+ *   （点の番号は左列が上から1, 2, 3, 7、右列が4, 5, 6, 8）
+ * - braille_utf8[p]: 点の並びpの点字のUTF-8（3バイト、p == 0は空白1文字で代用）
+ */
+static const uint8_t braille_pair[4][4] = {
+    { 0x00, 0x01, 0x08, 0x09 },
+    { 0x00, 0x02, 0x10, 0x12 },
+    { 0x00, 0x04, 0x20, 0x24 },
+    { 0x00, 0x40, 0x80, 0xC0 },
+};
+static char braille_utf8[256][3];
+
+static void braille_init(void){
+    for (int p = 0; p < 256; p++){
+        braille_utf8[p][0] = (char)0xE2;
+        braille_utf8[p][1] = (char)(0xA0 | (p >> 6));
+        braille_utf8[p][2] = (char)(0x80 | (p & 0x3F));
+    }
+}
+
+/*
+ * 表示上の1ドット行dyの、dx0番目からn個のドットを読み出す
+ * - キャンバスの外は空白にする
+ */
+static void screen_read_dots(const Screen *s, const Canvas *c, const int64_t dy, const int64_t dx0, int64_t n, char *dst){
+    const int64_t y = s->y + dy * s->zoom;
+    const int64_t x = s->x + dx0 * s->zoom;
+    int64_t m = (y < c->height && x < c->width) ? (c->width - x + s->zoom - 1) / s->zoom : 0;
+    if (m > n) m = n;
+    if (s->zoom == 1){
+        canvas_read_row(c, y, x, m, dst);
+    } else if (m > 0){
+        canvas_read_zoomed(c, y, x, m, s->zoom, dst);
+    }
+    memset(dst + m, ' ', (size_t)(n - m));
+}
+
+/*
+ * 表示上の(sx, sy)から横n個のセルを読み出す
+ * - 縮小表示中はcanvas_read_zoomedでまとめたセルを読む
+ * - 点字表示では4つのドット行を読み、2ドットずつ表で点のビットに変換して重ねる
+ */
+static void screen_read_row(const Screen *s, const Canvas *c, const int64_t sy, const int64_t sx, const int64_t n, char *dst){
+    if (s->braille){
+        uint8_t *p = (uint8_t *)dst;
+        memset(p, 0, (size_t)n);
+        for (int r = 0; r < 4; r++){
+            screen_read_dots(s, c, sy * 4 + r, sx * 2, n * 2, s->dots);
+            const char *d = s->dots;
+            for (int64_t j = 0; j < n; j++){
+                p[j] |= braille_pair[r][(d[2 * j] != ' ') | ((d[2 * j + 1] != ' ') << 1)];
+            }
+        }
+    } else {
+        screen_read_dots(s, c, sy, sx, n, dst);
+    }
+}
+
+/*
+ * 表示範囲の大きさをw x hにする
+ * - 次のupdate_screenで全体を読み直させる
+ * - 確保に失敗した場合は元の状態のまま-1を返す
+ */
+static int screen_resize(Screen *s, const int64_t w, const int64_t h){
+    char *cells = (char *)malloc((size_t)w * h);
+    char *dots = (char *)malloc((size_t)w * 2);
+    if (cells == NULL || dots == NULL){
+        free(cells);
+        free(dots);
+        return -1;
+    }
+    free(s->cells);
+    free(s->dots);
+    s->cells = cells;
+    s->dots = dots;
+    s->width = w;
+    s->height = h;
+    s->valid = 0;
+    return 0;
+}
+
+/*
+ * 表示範囲の内容を作成する
+ * - キャンバスの表示範囲に合わせた大きさで作る
+ * - 中身は次のupdate_screenで読み込む
+ */
+Screen *init_screen(const Canvas *c){
+    Screen *s = (Screen *)malloc(sizeof(Screen));
+    if (s == NULL) return NULL;
+    s->cells = NULL;
+    s->dots = NULL;
+    s->x = c->view.x0;
+    s->y = c->view.y0;
+    s->zoom = c->zoom;
+    s->braille = c->braille;
+    if (screen_resize(s, screen_cols(c), screen_rows(c)) != 0){
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void free_screen(Screen *s){
+    free(s->cells);
+    free(s->dots);
+    free(s);
+}
+
+/*
+ * 表示範囲の内容をキャンバスに合わせる
+ * - 表示範囲の大きさ・位置・縮小率・点字表示が変わった場合は全体を読み直す
+ * - それ以外は、キャンバスの書き換わった範囲（dirty）のうち表示しているセルに
+ *   掛かる部分だけを読み直す
+ */
+void update_screen(Screen *s, Canvas *c){
+    if (screen_cols(c) != s->width || screen_rows(c) != s->height){
+        if (screen_resize(s, screen_cols(c), screen_rows(c)) != 0){
+            // 確保できない場合は表示範囲の変更を取り消す
+            c->zoom = s->zoom;
+            c->braille = s->braille;
+            canvas_set_view(c, s->x, s->y, s->width * canvas_cell_w(c), s->height * canvas_cell_h(c));
+        }
+    }
+    const CanvasRect v = c->view;
+    const int64_t width = s->width;
+    const int64_t height = s->height;
+    const int64_t cw = canvas_cell_w(c);  // 表示の1セルが覆うセル数
+    const int64_t ch = canvas_cell_h(c);
+    if (v.x0 != s->x || v.y0 != s->y || c->zoom != s->zoom || c->braille != s->braille){
+        s->valid = 0;
+    }
+    s->x = v.x0;
+    s->y = v.y0;
+    s->zoom = c->zoom;
+    s->braille = c->braille;
+
+    // 読み直す範囲（表示上のセルの位置）
+    CanvasRect d = { .x0 = 0, .y0 = 0, .x1 = width - 1, .y1 = height - 1 };
+    if (s->valid){
+        // 書き換わった範囲のうち、表示しているセルに掛かる部分
+        // （縮小表示の右端・下端のセルは表示範囲の外にはみ出すことがある）
+        CanvasRect w;
+        int any = canvas_get_dirty(c, &w);
+        if (w.x0 < v.x0) w.x0 = v.x0;
+        if (w.y0 < v.y0) w.y0 = v.y0;
+        if (w.x1 > v.x0 + width * cw - 1) w.x1 = v.x0 + width * cw - 1;
+        if (w.y1 > v.y0 + height * ch - 1) w.y1 = v.y0 + height * ch - 1;
+        any = any && w.x0 <= w.x1 && w.y0 <= w.y1;
+        d = (CanvasRect){ .x0 = (w.x0 - v.x0) / cw, .y0 = (w.y0 - v.y0) / ch,
+                          .x1 = (w.x1 - v.x0) / cw, .y1 = (w.y1 - v.y0) / ch };
+        if (!any) d.y1 = d.y0 - 1;
+    }
+    for (int64_t sy = d.y0; sy <= d.y1; sy++){
+        screen_read_row(s, c, sy, d.x0, d.x1 - d.x0 + 1, s->cells + (size_t)sy * width + d.x0);
+    }
+    s->valid = 1;
+    // 表示範囲の外の変化は、表示範囲が変わったときに全体を読み直すので捨ててよい
+    canvas_clear_dirty(c);
+}
+
+/*
+ * 端末への差分出力（描画スレッド側）
+ * - 前回端末に出力した内容を覚えておき、変化したセルだけを出力する
+ * - フレームの出力は、前回のフレームのプロンプト行から入力された行数だけ
+ *   下にあるカーソルを枠の左上まで巻き戻すところから始まり、
+ *   結果メッセージを出力してプロンプト行に戻ったところで終わる
+ * - 1フレーム分の出力はRendererのバッファに組み立て、1回のwriteで出力する
+ */
+
+/*
+ * 引数が1つのエスケープシーケンス（CSI n C、CSI n bなど）のバイト数
+ * - カーソル移動や繰り返しと、そのまま書き出すのとの比較に使う
+ */
+static int csi_cost(const int64_t n){
+    int digits = 1;
+    for (int64_t m = n; m >= 10; m /= 10) digits++;
+    return 3 + digits;  // "\e[" + 数字 + 終端文字
+}
+
+/*
+ * カーソルを枠の左上を原点とする(row, col)に移動する
+ * - rewind_screenと同じく相対移動のエスケープシーケンスを使う
+ */
+static void render_move(Renderer *r, const int64_t row, const int64_t col){
+    if (row > r->cur_row) frame_csi(&r->out, row - r->cur_row, 'B');
+    if (row < r->cur_row) frame_csi(&r->out, r->cur_row - row, 'A');
+    if (col != r->cur_col){
+        if (col == 0) frame_append(&r->out, "\r", 1);
+        else if (col > r->cur_col) frame_csi(&r->out, col - r->cur_col, 'C');
+        else frame_csi(&r->out, r->cur_col - col, 'D');
+    }
+    r->cur_row = row;
+    r->cur_col = col;
+}
+
+/*
+ * n個のセルpをそのまま出力する
+ * - 点字表示ではセルの点の並びを点字のUTF-8に変換する
+ */
+static void render_put(Renderer *r, const char *p, const int64_t n){
+    if (!r->braille){
+        frame_append(&r->out, p, (size_t)n);
+        return;
+    }
+    for (int64_t i = 0; i < n; i++){
+        const uint8_t v = (uint8_t)p[i];
+        if (v == 0) frame_append(&r->out, " ", 1);
+        else frame_append(&r->out, braille_utf8[v], 3);
+    }
+}
+
+/*
+ * カーソル位置からn個のセルpを出力する
+ * - underは出力先に今表示されている内容（NULLなら消去済みで空白）
+ * - 同じ文字の連続ごとに、短くなる場合は次のように圧縮する
+ *   - 表示済みの空白に空白を書く区間: カーソル移動（CSI n C）で飛ばす
+ *   - それ以外: 1文字書いてから繰り返し（CSI n b）を使う（--repを指定した場合）
+ *     - 点字（ASCII以外）の繰り返しに対応しない端末があるので、点字表示では空白だけ
+ * - plainの場合はそのまま出力する
+ * - どの場合もカーソルはn列進む
+ */
+static void render_cells(Renderer *r, const char *p, const char *under, const int64_t n){
+    if (r->plain){
+        render_put(r, p, n);
+        return;
+    }
+    int64_t i = 0;
+    while (i < n){
+        int64_t j = i + 1;
+        while (j < n && p[j] == p[i]) j++;
+        const int64_t len = j - i;
+
+        int blank = (p[i] == r->blank);
+        for (int64_t k = i; blank && under != NULL && k < j; k++){
+            blank = (under[k] == r->blank);
+        }
+        if (blank && len > csi_cost(len)){
+            frame_csi(&r->out, len, 'C');
+        } else if (r->rep && (!r->braille || p[i] == r->blank) && len - 1 > csi_cost(len - 1)){
+            render_put(r, p + i, 1);
+            frame_csi(&r->out, len - 1, 'b');
+        } else {
+            render_put(r, p + i, len);
+        }
+        i = j;
+    }
+}
+
+/*
+ * 端末に表示するフレームの大きさをw x hにする
+ * - shownと枠線を作り直し、全体を出力させる
+ * - 確保に失敗した場合は元の状態のまま-1を返す
+ */
+static int render_resize(Renderer *r, const int64_t w, const int64_t h){
+    char *shown = (char *)malloc((size_t)w * h);
+    FrameBuf border = { .buf = NULL, .len = 0, .cap = 0 };
+
+    // 枠線: "+" + "-"をw個 + "+\n"
+    if (r->rep && w - 1 > csi_cost(w - 1)){
+        frame_puts(&border, "+-");
+        frame_csi(&border, w - 1, 'b');
+        frame_puts(&border, "+\n");
+    } else {
+        char *p = frame_reserve(&border, (size_t)w + 3);
+        if (p != NULL) fill_border(p, w);
+    }
+
+    if (shown == NULL || border.buf == NULL){
+        free(shown);
+        free(border.buf);
+        return -1;
+    }
+    free(r->shown);
+    free(r->border.buf);
+    r->shown = shown;
+    r->border = border;
+    r->width = w;
+    r->height = h;
+    r->valid = 0;
+    return 0;
+}
+
+/*
+ * 1フレームを端末に出力する
+ * - 初回と大きさ・表示方法が変わったときは、以前の表示を消去してから
+ *   枠を含めて全体を出力する（print_canvasと同じ見た目）
+ * - それ以外は前回の出力と異なるセルだけを出力する
+ *   - 変化したセルの間に変化していないセルがある場合、カーソル移動と
+ *     そのまま書き直すのとでバイト数の少ない方を選ぶ
+ * - 書き出すセルはrender_cellsで圧縮する
+ * - 枠の下の行に結果メッセージ、その上の行にプロンプトを出力する
+ */
+static void render_frame(Renderer *r, const Frame *f){
+    const int64_t prompt_row = r->height + 2;  // 前回のフレームのプロンプト行
+    if ((f->width != r->width || f->height != r->height) && render_resize(r, f->width, f->height) != 0){
+        return;  // このフレームは出力しない（次のフレームで巻き戻す行数に含める）
+    }
+    if (f->braille != r->braille){
+        r->braille = f->braille;
+        r->blank = r->braille ? 0 : ' ';
+        r->valid = 0;
+    }
+    const int64_t width = r->width;
+    const int64_t height = r->height;
+
+    /*
+     * 枠の左上まで巻き戻す
+     * - 前回のプロンプト以降に入力された行（端末がエコーした分）と
+     *   結果メッセージを消しながら上に戻る
+     */
+    if (!r->started){
+        frame_puts(&r->out, "\n");  // Windows環境用の改行
+        r->started = 1;
+    } else {
+        clear_command(&r->out);
+        for (long k = r->lines; k < f->lines; k++){
+            rewind_screen(&r->out, 1);
+            clear_command(&r->out);
+        }
+        rewind_screen(&r->out, (unsigned int)prompt_row);
+
+        /*
+         * 貼り付けなどで複数行がエコーされた場合、端末がスクロールして
+         * 枠の上の方が画面外に出ていることがある
+         * - カーソルの巻き戻しは画面の最上行で止まり、前回の出力と位置がずれるので、
+         *   差分ではなく全体を出力し直す
+         */
+        if (f->lines - r->lines > 1){
+            r->valid = 0;
+        }
+    }
+    r->cur_row = 0;
+    r->cur_col = 0;
+
+    if (!r->valid){
+        // 消去済みの行に書くので、空白はカーソル移動で飛ばせる
+        frame_puts(&r->out, "\e[J");
+        frame_append(&r->out, r->border.buf, r->border.len);
+        for (int64_t y = 0; y < height; y++){
+            const char *cells = f->cells + (size_t)y * width;
+            frame_append(&r->out, "|", 1);
+            render_cells(r, cells, NULL, width);
+            frame_append(&r->out, "|\n", 2);
+        }
+        frame_append(&r->out, r->border.buf, r->border.len);
+        memcpy(r->shown, f->cells, (size_t)width * height);
+        r->valid = 1;
+        r->cur_row = height + 2;
+    } else {
+        for (int64_t y = 0; y < height; y++){
+            const char *now = f->cells + (size_t)y * width;
+            char *old = r->shown + (size_t)y * width;
+            if (memcmp(now, old, (size_t)width) == 0) continue;
+
+            int64_t i = 0;
+            while (i < width){
+                if (now[i] == old[i]){
+                    i++;
+                    continue;
+                }
+
+                // 変化したセルから、続く変化をまとめて出力する範囲[i, j)を決める
+                int64_t j = i;
+                while (j < width){
+                    while (j < width && now[j] != old[j]) j++;
+                    if (j == width) break;
+                    // 変化していない区間の長さ
+                    int64_t g = j;
+                    while (g < width && now[g] == old[g]) g++;
+                    if (g == width || (g - j) * (r->braille ? 3 : 1) > csi_cost(g - j)) break;
+                    // 短い区間はカーソル移動より書き直した方が少ない（点字は1セル3バイト）
+                    j = g;
+                }
+
+                // 変化したセルまで移動して出力する
+                // （画面上は枠の分だけ1行・1列ずれる）
+                render_move(r, y + 1, i + 1);
+                render_cells(r, now + i, old + i, j - i);
+                r->cur_col += j - i;
+                i = j;
+            }
+            memcpy(old, now, (size_t)width);
+        }
+    }
+
+    // 結果メッセージ（枠の2行下）とプロンプト（枠の1行下）
+    if (f->status != NULL){
+        render_move(r, height + 3, 0);
+        clear_command(&r->out);
+        frame_puts(&r->out, f->status);
+        r->cur_col = (int64_t)strlen(f->status);
+    }
+    render_move(r, height + 2, 0);
+    frame_puts(&r->out, "* > ");
+    r->lines = f->lines;
+    flush_frame(&r->out);
+}
+
+/*
+ * 時刻aがbより前か
+ */
+static int time_before(const struct timespec *a, const struct timespec *b){
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * 描画スレッドの本体
+ * - 新しいフレームが公開されるのを待ち、公開されたらworkと入れ替えて出力する
+ * - 前のフレームからinterval経っていなければ、経つまで待ってから出力する
+ * - 出力している間や待っている間に公開されたフレームは、最新のものだけが
+ *   次に出力される（続けて入力されたコマンドの再描画は1回にまとまる）
+ */
+static void *render_main(void *arg){
+    Renderer *r = (Renderer *)arg;
+    pthread_mutex_lock(&r->lock);
+    while (1){
+        while (!r->fresh && !r->quit){
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        while (!r->quit && r->interval > 0){
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (!time_before(&now, &r->next)) break;
+            pthread_cond_timedwait(&r->cond, &r->lock, &r->next);
+        }
+        if (r->quit) break;
+        Frame *f = r->front;
+        r->front = r->work;
+        r->work = f;
+        r->fresh = 0;
+        pthread_mutex_unlock(&r->lock);
+
+        if (r->interval > 0){
+            clock_gettime(CLOCK_MONOTONIC, &r->next);
+            r->next.tv_sec += (r->next.tv_nsec + r->interval) / 1000000000;
+            r->next.tv_nsec = (r->next.tv_nsec + r->interval) % 1000000000;
+        }
+        render_frame(r, r->work);
+
+        pthread_mutex_lock(&r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/*
+ * 描画スレッドを開始する
+ * - repなら（plainでない場合）、同じ文字の連続を繰り返し（REP）で圧縮する
+ * - fpsは毎秒出力するフレーム数の上限（0なら制限しない）
+ * - 最初のフレームはpublish_frameで渡す
+ */
+Renderer *start_renderer(const int plain, const int rep, const int fps){
+    Renderer *r = (Renderer *)malloc(sizeof(Renderer));
+    if (r == NULL) return NULL;
+    r->width = 0;
+    r->height = 0;
+    r->braille = 0;
+    r->blank = ' ';
+    r->shown = NULL;
+    r->border = (FrameBuf){ .buf = NULL, .len = 0, .cap = 0 };
+    r->out = (FrameBuf){ .buf = NULL, .len = 0, .cap = 0 };
+    r->plain = plain;
+    r->rep = !plain && rep;
+    r->valid = 0;
+    r->started = 0;
+    r->lines = 0;
+    r->cur_row = 0;
+    r->cur_col = 0;
+    r->interval = (fps > 0) ? 1000000000 / fps : 0;
+    clock_gettime(CLOCK_MONOTONIC, &r->next);
+    for (int i = 0; i < 3; i++){
+        r->frames[i] = (Frame){ .width = 0, .height = 0, .braille = 0, .cells = NULL, .cap = 0, .lines = 0, .status = NULL };
+    }
+    r->back = &r->frames[0];
+    r->front = &r->frames[1];
+    r->work = &r->frames[2];
+    r->fresh = 0;
+    r->quit = 0;
+    braille_init();
+
+    // 待ち時間をCLOCK_MONOTONICで指定するため
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&r->thread, NULL, render_main, r) != 0){
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/*
+ * 表示範囲の内容をフレームとして描画スレッドに渡す
+ * - backに書いてからfrontと入れ替える（ロックしている間はポインタの入れ替えだけ）
+ * - statusは結果メッセージ、linesはここまでに読み込んだ入力の行数
+ */
+void publish_frame(Renderer *r, const Screen *s, const char *status, const long lines){
+    Frame *b = r->back;
+    const size_t n = (size_t)s->width * s->height;
+    if (b->cap < n){
+        char *cells = (char *)realloc(b->cells, n);
+        if (cells == NULL) return;  // このフレームは渡さない
+        b->cells = cells;
+        b->cap = n;
+    }
+    memcpy(b->cells, s->cells, n);
+    b->width = s->width;
+    b->height = s->height;
+    b->braille = s->braille;
+    b->lines = lines;
+    b->status = status;
+
+    pthread_mutex_lock(&r->lock);
+    r->back = r->front;
+    r->front = b;
+    r->fresh = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * 描画スレッドを終了させ、画面をクリアしてから解放する
+ * - まだ出力されていないフレームは出力しない
+ */
+void stop_renderer(Renderer *r){
+    pthread_mutex_lock(&r->lock);
+    r->quit = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+
+    clear_screen(&r->out);
+    flush_frame(&r->out);
+
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    for (int i = 0; i < 3; i++){
+        free(r->frames[i].cells);
+    }
+    free(r->shown);
+    free(r->border.buf);
+    free(r->out.buf);
+    free(r);
+}
+
+/*
+ * 標準入力に読み込める入力が溜まっているか
+ * - 端末の入力は1行ずつ読み込まれるので、次の行が届いていればpollで分かる
+ * - EOFも読み込める入力として扱う（次のfgetsがすぐに返る）
+ */
+int input_pending(void){
+    struct pollfd p = { .fd = STDIN_FILENO, .events = POLLIN, .revents = 0 };
+    return poll(&p, 1, 0) > 0;
+}
+
+
+/*
+ * 線の点i（0 <= i <= dm）のうちキャンバス内に入る範囲[*lo, *hi]を求める
+ * - 長い方の軸の位置はm0 + sm * i（範囲は[0, lim_m)）
+ * - 短い方の軸の位置はn0 + sn * (i * dn / dm)（切り捨て、範囲は[0, lim_n)）
+ * - iは長い方の軸で決まる範囲に、短い方の軸の範囲をi * dn / dmの逆算で絞り込む
+ * - 1点も入らなければ0を返す
+ */
+static int line_clip(const int64_t m0, const int64_t sm, const int64_t lim_m,
+                     const int64_t n0, const int64_t sn, const int64_t lim_n,
+                     const int64_t dm, const int64_t dn, int64_t *lo, int64_t *hi){
+    // 長い方の軸
+    int64_t a = (sm > 0) ? -m0 : m0 - lim_m + 1;
+    int64_t b = (sm > 0) ? lim_m - 1 - m0 : m0;
+    if (a < 0) a = 0;
+    if (b > dm) b = dm;
+
+    // 短い方の軸（q = i * dn / dmの範囲）
+    int64_t qa = (sn > 0) ? -n0 : n0 - lim_n + 1;
+    int64_t qb = (sn > 0) ? lim_n - 1 - n0 : n0;
+    if (qa < 0) qa = 0;
+    if (qb > dn) qb = dn;
+    if (qa > qb) return 0;
+    if (dn > 0){
+        // q >= qa ⇔ i >= ceil(qa * dm / dn)、q <= qb ⇔ i < ceil((qb + 1) * dm / dn)
+        const int64_t ia = (qa * dm + dn - 1) / dn;
+        const int64_t ib = ((qb + 1) * dm + dn - 1) / dn - 1;
+        if (a < ia) a = ia;
+        if (b > ib) b = ib;
+    }
+    *lo = a;
+    *hi = b;
+    return a <= b;
+}
+
+/*
+ * (x0, y0)から(x1, y1)まで（両端を含む）の線を描く
+ * - n = max(|x1 - x0|, |y1 - y0|)として、i = 0, 1, ..., nについて
+ *   (x0 + i * (x1 - x0) / n, y0 + i * (y1 - y0) / n)（0方向への切り捨て）の点を塗る
+ * - 先にline_clipでキャンバス内に入る点の範囲を求め、その範囲だけを塗る
+ *   （キャンバス外の部分の長さによらず、塗る点の数に比例した時間で終わる）
+ * - 長い方の軸は1点ごとに1進み、短い方の軸の i * d / n は誤差を足し込んで
+ *   nを超えたら1進めることで求める（ループ内で割り算をしない）
+ * - 水平・垂直な線は区間としてまとめて塗り、45度の線は誤差の計算を省く
+ */
+void draw_line(Canvas *c, const int64_t x0, const int64_t y0, const int64_t x1, const int64_t y1)
+{
+    if (y0 == y1){
+        canvas_hspan(c, x0, x1, y0, c->pen);
+        return;
+    }
+    if (x0 == x1){
+        canvas_vspan(c, x0, y0, y1, c->pen);
+        return;
+    }
+
+    const int64_t dx = llabs(x1 - x0);
+    const int64_t dy = llabs(y1 - y0);
+    const int64_t sx = (x1 > x0) ? 1 : -1;
+    const int64_t sy = (y1 > y0) ? 1 : -1;
+    const int xmajor = (dx >= dy);
+    const int64_t dm = xmajor ? dx : dy;  // 長い方の軸の長さ
+    const int64_t dn = xmajor ? dy : dx;  // 短い方の軸の長さ
+
+    int64_t lo, hi;
+    if (xmajor){
+        if (!line_clip(x0, sx, c->width, y0, sy, c->height, dx, dy, &lo, &hi)) return;
+    } else {
+        if (!line_clip(y0, sy, c->height, x0, sx, c->width, dy, dx, &lo, &hi)) return;
+    }
+
+    const int v = canvas_value_of(c, c->pen);
+    if (v < 0) return;
+
+    // 最初の点と誤差（割り算はここだけ）
+    int64_t q = lo * dn / dm;
+    int64_t err = lo * dn % dm;  // i * dn % dm
+    int64_t x = x0 + sx * (xmajor ? lo : q);
+    int64_t y = y0 + sy * (xmajor ? q : lo);
+
+    // 書き換わる範囲は最初の点と最後の点を囲む矩形
+    const int64_t qe = hi * dn / dm;
+    const int64_t xe = x0 + sx * (xmajor ? hi : qe);
+    const int64_t ye = y0 + sy * (xmajor ? qe : hi);
+    canvas_mark_dirty(c, (x < xe) ? x : xe, (y < ye) ? y : ye, (x < xe) ? xe : x, (y < ye) ? ye : y);
+
+    if (dx == dy){
+        for (int64_t i = lo; i <= hi; i++, x += sx, y += sy){
+            canvas_plot(c, x, y, (unsigned)v);
+        }
+    } else if (xmajor){
+        for (int64_t i = lo; i <= hi; i++, x += sx){
+            canvas_plot(c, x, y, (unsigned)v);
+            err += dy;
+            if (err >= dx){
+                err -= dx;
+                y += sy;
+            }
+        }
+    } else {
+        for (int64_t i = lo; i <= hi; i++, y += sy){
+            canvas_plot(c, x, y, (unsigned)v);
+            err += dx;
+            if (err >= dy){
+                err -= dy;
+                x += sx;
+            }
+        }
+    }
+}
+
+/*
+ * y行目のx0からx1まで（両端を含む）をchで塗る
+ * - キャンバス外の部分は切り捨てる
+ * - 行優先なので区間は連続しており、cells_fillで一度に書き込める
+ *   （タイル方式ではタイルごとに書き込む）
+ */
+void canvas_hspan(Canvas *c, int64_t x0, int64_t x1, const int64_t y, const char ch){
+    if (x0 > x1){
+        const int64_t t = x0; x0 = x1; x1 = t;
+    }
+    if (y < 0 || y >= c->height || x1 < 0 || x0 >= c->width) return;
+    if (x0 < 0) x0 = 0;
+    if (x1 >= c->width) x1 = c->width - 1;
+
+    const int v = canvas_value_of(c, ch);
+    if (v < 0) return;
+    canvas_mark_dirty(c, x0, y, x1, y);
+
+    if (c->backend == CANVAS_TILED){
+        for (int64_t x = x0; x <= x1; ){
+            const int64_t tile_end = x | CANVAS_TILE_MASK;  // このタイルの右端
+            const int64_t last = (tile_end < x1) ? tile_end : x1;
+            uint8_t *row = canvas_row_for_write(c, x, y);
+            if (row != NULL) cells_fill(row, canvas_col(c, x), last - x + 1, c->bpp, (unsigned)v);
+            x = last + 1;
+        }
+        return;
+    }
+
+    cells_fill(c->data + (size_t)y * c->stride, x0, x1 - x0 + 1, c->bpp, (unsigned)v);
+}
+
+/*
+ * x列目のy0からy1まで（両端を含む）をchで塗る
+ * - キャンバス外の部分は切り捨てる
+ * - 格納値の変換と書き換わった範囲の更新は1回だけ行う
+ */
+void canvas_vspan(Canvas *c, const int64_t x, int64_t y0, int64_t y1, const char ch){
+    if (y0 > y1){
+        const int64_t t = y0; y0 = y1; y1 = t;
+    }
+    if (x < 0 || x >= c->width || y1 < 0 || y0 >= c->height) return;
+    if (y0 < 0) y0 = 0;
+    if (y1 >= c->height) y1 = c->height - 1;
+
+    const int v = canvas_value_of(c, ch);
+    if (v < 0) return;
+    canvas_mark_dirty(c, x, y0, x, y1);
+
+    if (c->backend == CANVAS_TILED){
+        for (int64_t y = y0; y <= y1; y++) canvas_plot(c, x, y, (unsigned)v);
+        return;
+    }
+
+    uint8_t *row = c->data + (size_t)y0 * c->stride;
+    for (int64_t y = y0; y <= y1; y++, row += c->stride) cell_store(row, x, c->bpp, (unsigned)v);
+}
+
+/*
+ * (x0, y0)-(x1, y1)（両端を含む）をchで塗りつぶす
+ * - キャンバス外の部分は切り捨てる
+ * - 各行の区間をcells_fillで一度に書き込む（タイル方式ではタイルごとに書き込む）
+ * - 格納値の変換と書き換わった範囲の更新は1回だけ行う
+ */
+void canvas_fill_rect(Canvas *c, int64_t x0, int64_t y0, int64_t x1, int64_t y1, const char ch){
+    if (x1 < 0 || x0 >= c->width || y1 < 0 || y0 >= c->height || x0 > x1 || y0 > y1) return;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 >= c->width) x1 = c->width - 1;
+    if (y1 >= c->height) y1 = c->height - 1;
+
+    const int v = canvas_value_of(c, ch);
+    if (v < 0) return;
+    canvas_mark_dirty(c, x0, y0, x1, y1);
+
+    if (c->backend == CANVAS_TILED){
+        for (int64_t y = y0; y <= y1; y++){
+            for (int64_t x = x0; x <= x1; ){
+                const int64_t tile_end = x | CANVAS_TILE_MASK;  // このタイルの右端
+                const int64_t last = (tile_end < x1) ? tile_end : x1;
+                uint8_t *row = canvas_row_for_write(c, x, y);
+                if (row != NULL) cells_fill(row, canvas_col(c, x), last - x + 1, c->bpp, (unsigned)v);
+                x = last + 1;
+            }
+        }
+        return;
+    }
+
+    uint8_t *row = c->data + (size_t)y0 * c->stride;
+    for (int64_t y = y0; y <= y1; y++, row += c->stride){
+        cells_fill(row, x0, x1 - x0 + 1, c->bpp, (unsigned)v);
+    }
+}
+
+/*
+ * (x0, y0)-(x1, y1)を角とする長方形の輪郭を現在の太さ（c->brush）で描く
+ * - 各辺をdraw_brush_lineと同じく-(N - 1) / 2から+N / 2までずらした範囲を塗り、
+ *   角は正方形に埋める
+ * - 外側の長方形から内側の長方形を除いた部分を、上下の帯と左右の帯の
+ *   4つの長方形として塗る（内側がなければ外側の長方形を塗りつぶす）
+ */
+static void draw_brush_rect(Canvas *c, const int64_t x0, const int64_t y0, const int64_t x1, const int64_t y1){
+    const int64_t a = (c->brush - 1) / 2;
+    const int64_t b = c->brush / 2;
+    if (x1 - a - 1 < x0 + b + 1 || y1 - a - 1 < y0 + b + 1){
+        canvas_fill_rect(c, x0 - a, y0 - a, x1 + b, y1 + b, c->pen);
+        return;
+    }
+    canvas_fill_rect(c, x0 - a, y0 - a, x1 + b, y0 + b, c->pen);
+    canvas_fill_rect(c, x0 - a, y1 - a, x1 + b, y1 + b, c->pen);
+    canvas_fill_rect(c, x0 - a, y0 + b + 1, x0 + b, y1 - a - 1, c->pen);
+    canvas_fill_rect(c, x1 - a, y0 + b + 1, x1 + b, y1 - a - 1, c->pen);
+}
+
+void draw_rect(Canvas *c, const int64_t x0, const int64_t y0, const int64_t width, const int64_t height){
     if (width <= 0 || height <= 0) return;
 
-    int x1 = x0 + width - 1;
-    int y1 = y0 + height - 1;
+    int64_t x1 = x0 + width - 1;
+    int64_t y1 = y0 + height - 1;
+    if (c->brush > 1){
+        draw_brush_rect(c, x0, y0, x1, y1);
+        return;
+    }
+    if (x1 < 0 || x0 >= c->width || y1 < 0 || y0 >= c->height) return;  // キャンバスと重ならない
 
-    draw_line(c, x0, y0, x1, y0);
-    draw_line(c, x0, y1, x1, y1);
+    // 上下の辺は水平な区間なので行単位で塗る
+    canvas_hspan(c, x0, x1, y0, c->pen);
+    canvas_hspan(c, x0, x1, y1, c->pen);
     draw_line(c, x0, y0, x0, y1);
     draw_line(c, x1, y0, x1, y1);
 }
 
-void draw_circle(Canvas *c, const int x0, const int y0, const int r){
+// 左上(x0, y0)、幅width、高さheightの長方形を塗りつぶす
+void draw_fillrect(Canvas *c, const int64_t x0, const int64_t y0, const int64_t width, const int64_t height){
+    if (width <= 0 || height <= 0) return;
+
+    canvas_fill_rect(c, x0, y0, x0 + width - 1, y0 + height - 1, c->pen);
+}
+
+// 整数の平方根（floor(sqrt(n))、n >= 0）
+static int64_t isqrt64(const int64_t n){
+    uint64_t rest = (uint64_t)n;
+    uint64_t root = 0;
+    uint64_t bit = (uint64_t)1 << 62;
+    while (bit > rest) bit >>= 2;
+    while (bit != 0){
+        if (rest >= root + bit){
+            rest -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (int64_t)root;
+}
+
+/*
+ * 中点アルゴリズムで1/8円の行yにあるxを求める
+ * - (x - 1/2)^2 + y^2 < r^2 となる最大のx（0 <= y < r）
+ *   （(2x - 1)^2 < 4(r^2 - y^2) となる最大の奇数2x - 1から求める）
+ */
+static int64_t circle_x_at(const int64_t r, const int64_t y){
+    if (y >= r) return 0;  // 1/8円より先
+    const int64_t k = isqrt64(4 * (r * r - y * y) - 1);
+    return ((k & 1) ? k + 1 : k) / 2;
+}
+
+// (x0, y0)を中心に(x, y)と上下左右に対称な4点を塗る（checkなら範囲を確認する）
+static inline void circle_plot4(Canvas *c, const int64_t x0, const int64_t y0, const int64_t x, const int64_t y, const unsigned v, const int check){
+    const int64_t px[4] = { x0 + x, x0 - x, x0 + x, x0 - x };
+    const int64_t py[4] = { y0 + y, y0 + y, y0 - y, y0 - y };
+    for (int k = 0; k < 4; k++){
+        if (!check || canvas_contains(c, px[k], py[k])) canvas_plot(c, px[k], py[k], v);
+    }
+}
+
+// (x0, y0)を中心に(x, y)と対称な8点を塗る（checkなら範囲を確認する）
+static inline void circle_plot8(Canvas *c, const int64_t x0, const int64_t y0, const int64_t x, const int64_t y, const unsigned v, const int check){
+    const int64_t px[8] = { x0 + x, x0 - x, x0 + x, x0 - x, x0 + y, x0 - y, x0 + y, x0 - y };
+    const int64_t py[8] = { y0 + y, y0 + y, y0 - y, y0 - y, y0 + x, y0 + x, y0 - x, y0 - x };
+    for (int k = 0; k < 8; k++){
+        if (!check || canvas_contains(c, px[k], py[k])) canvas_plot(c, px[k], py[k], v);
+    }
+}
+
+/*
+ * 1/8円の行yのxがk以上になる最大のy（なければ-1、0 <= k <= r）
+ * - circle_x_atの条件を逆に解いて、4y^2 < 4r^2 - (2k - 1)^2 となる最大のy
+ */
+static int64_t circle_y_reach(const int64_t r, const int64_t k){
+    if (k <= 0) return r;
+    const int64_t t = 4 * r * r - (2 * k - 1) * (2 * k - 1);
+    return (t <= 0) ? -1 : isqrt64(t - 1) / 2;
+}
+
+/*
+ * 中心(x0, y0)、半径rの円を描く（中点アルゴリズム）
+ * - x >= yの1/8円をy = 0から1ずつ進め、xを減らすかどうかを整数の判定値
+ *   d = x^2 - x + (y + 1)^2 - r^2 の符号で決める（浮動小数点数を使わない）
+ * - 輪郭は、1/8円の各点から対称な8点を塗るので、半径によらず隙間ができない
+ *   （円がキャンバスに収まっていれば範囲の確認を省く）
+ * - fillなら、行ごとに最も外側の点の間を水平な区間として1回だけ塗る
+ *   - 点(x, y)の行y0 ± yは、x0 - xからx0 + xまで（各yで1回）
+ *   - 行y0 ± xは、xが減る直前（その行で最も外側の点）のyを幅として1回
+ * - はみ出している場合は、どの点（fillなら行）もキャンバスに入らないyの区間を
+ *   飛ばす（区間の最初のxはcircle_x_atで求める）ので、巨大な円でも
+ *   キャンバスの大きさに比例した時間で終わる
+ */
+static void circle(Canvas *c, const int64_t x0, const int64_t y0, const int64_t r, const int fill){
     if (r <= 0) return;
+    if (x0 + r < 0 || x0 - r >= c->width || y0 + r < 0 || y0 - r >= c->height) return;  // キャンバスと重ならない
+
+    const int v = canvas_value_of(c, c->pen);
+    if (v < 0) return;
+    const int check = !(x0 - r >= 0 && x0 + r < c->width && y0 - r >= 0 && y0 + r < c->height);
+    if (!fill){
+        canvas_mark_dirty(c, (x0 - r < 0) ? 0 : x0 - r, (y0 - r < 0) ? 0 : y0 - r,
+                          (x0 + r >= c->width) ? c->width - 1 : x0 + r, (y0 + r >= c->height) ? c->height - 1 : y0 + r);
+    }
+
+    /*
+     * 調べるyの区間
+     * - 8点のうち4点はy0 ± yの行、残りの4点は輪郭ならx0 ± yの列、fillならy0 ± xの行にある
+     * - 行y0 ± xがキャンバス内になるxの区間は、circle_y_reachでyの区間に直す
+     */
+    int64_t lo[4] = { -y0, y0 - c->height + 1, 0, 0 };
+    int64_t hi[4] = { c->height - 1 - y0, y0, r, r };
+    if (!check){
+        lo[0] = 0;
+        hi[0] = r;
+        lo[1] = lo[2] = lo[3] = r + 1;
+    } else if (!fill){
+        lo[2] = -x0;
+        hi[2] = c->width - 1 - x0;
+        lo[3] = x0 - c->width + 1;
+        hi[3] = x0;
+    } else {
+        for (int i = 0; i < 2; i++){
+            const int64_t ka = (lo[i] < 0) ? 0 : lo[i];
+            const int64_t kb = (hi[i] > r) ? r : hi[i];
+            lo[i + 2] = (ka > kb) ? r + 1 : circle_y_reach(r, kb + 1) + 1;
+            hi[i + 2] = (ka > kb) ? r : circle_y_reach(r, ka);
+        }
+    }
+    for (int i = 1; i < 4; i++){  // 区間の始まりの順に並べる
+        for (int j = i; j > 0 && lo[j - 1] > lo[j]; j--){
+            int64_t t = lo[j]; lo[j] = lo[j - 1]; lo[j - 1] = t;
+            t = hi[j]; hi[j] = hi[j - 1]; hi[j - 1] = t;
+        }
+    }
+
+    int64_t y = 0;  // 次に調べるy
+    for (int i = 0; i < 4; i++){
+        const int64_t a = (lo[i] > y) ? lo[i] : y;
+        const int64_t b = (hi[i] < r) ? hi[i] : r;
+        if (a > b) continue;
+        int64_t x = circle_x_at(r, a);
+        int64_t d = x * x - x + (a + 1) * (a + 1) - r * r;
+        for (y = a; y <= b && x >= y; y++){
+            if (fill){
+                canvas_hspan(c, x0 - x, x0 + x, y0 + y, c->pen);
+                if (y != 0) canvas_hspan(c, x0 - x, x0 + x, y0 - y, c->pen);
+            } else {
+                circle_plot8(c, x0, y0, x, y, (unsigned)v, check);
+            }
+            if (d < 0){
+                d += 2 * y + 3;
+            } else {
+                if (fill && x != y){
+                    canvas_hspan(c, x0 - y, x0 + y, y0 + x, c->pen);
+                    canvas_hspan(c, x0 - y, x0 + y, y0 - x, c->pen);
+                }
+                d += 2 * (y - x) + 5;
+                x--;
+            }
+        }
+        if (x < y) break;  // 1/8円の終わり
+    }
+}
+
+// 半径rの塗りつぶした円（circleのfill）の、中心から|h|行離れた行の半幅（h < 0やh > rなら-1）
+static int64_t circle_half_width(const int64_t r, const int64_t h){
+    if (r <= 0 || h < 0 || h > r) return -1;
+    const int64_t x = circle_x_at(r, h);
+    return (x >= h) ? x : circle_y_reach(r, h);  // 1/8円の先の行は、その行にある点のyの最大
+}
+
+/*
+ * 中心(x0, y0)、半径rの円を現在の太さ（c->brush）で描く
+ * - 半径r + N / 2の塗りつぶした円から、半径r - (N - 1) / 2 - 1の塗りつぶした円を
+ *   くり抜いた輪（各行で左右2つの区間）を塗る
+ * - 各行の区間の端はcircle_half_widthで直接求め、キャンバス内の行だけを調べる
+ */
+static void circle_ring(Canvas *c, const int64_t x0, const int64_t y0, const int64_t r){
+    const int64_t ro = r + c->brush / 2;            // 外側の半径
+    const int64_t ri = r - (c->brush - 1) / 2 - 1;  // くり抜く円の半径
+    if (ro <= 0) return;
+    const int64_t ya = (y0 - ro < 0) ? 0 : y0 - ro;
+    const int64_t yb = (y0 + ro >= c->height) ? c->height - 1 : y0 + ro;
+    if (x0 + ro < 0 || x0 - ro >= c->width || ya > yb) return;
+
+    for (int64_t y = ya; y <= yb; y++){
+        const int64_t h = llabs(y - y0);
+        const int64_t wo = circle_half_width(ro, h);
+        const int64_t wi = circle_half_width(ri, h);
+        if (wi < 0){
+            canvas_hspan(c, x0 - wo, x0 + wo, y, c->pen);
+        } else {
+            canvas_hspan(c, x0 - wo, x0 - wi - 1, y, c->pen);
+            canvas_hspan(c, x0 + wi + 1, x0 + wo, y, c->pen);
+        }
+    }
+}
+
+void draw_circle(Canvas *c, const int64_t x0, const int64_t y0, const int64_t r){
+    if (c->brush > 1){
+        if (r > 0) circle_ring(c, x0, y0, r);
+        return;
+    }
+    circle(c, x0, y0, r, 0);
+}
+
+void draw_fillcircle(Canvas *c, const int64_t x0, const int64_t y0, const int64_t r){
+    circle(c, x0, y0, r, 1);
+}
+
+/*
+ * 楕円の中点アルゴリズム（ellipse）の各行の点を、たどらずに直接求めるための式
+ * - a2 = rx^2, b2 = ry^2
+ * - 判定値の値はrx^2 * ry^2の桁になるので__int128で計算し、平方根をとる値は
+ *   4rx^2、4ry^2以下（int64_tに収まる）にしてからisqrt64を使う
+ */
+
+// 最初の領域で列xにある点のy（中点(x, y - 1/2)が楕円の内側になる最大のy、なければ0）
+static int64_t ellipse_y_at(const __int128 a2, const __int128 b2, const int64_t x){
+    const __int128 t = 4 * b2 * (a2 - (__int128)x * x);  // (2y - 1)^2 * rx^2 < t
+    if (t <= 0) return 0;
+    const int64_t m = isqrt64((int64_t)((t - 1) / a2));
+    const int64_t k = (m & 1) ? m : m - 1;  // 最大の奇数2y - 1
+    return (k + 1) / 2;
+}
+
+// 最初の領域で行y以上にある点の最大のx（中点(x, y - 1/2)が楕円の内側になる最大のx、1 <= y <= ry）
+static int64_t ellipse_x_reach(const __int128 a2, const __int128 b2, const int64_t y){
+    const __int128 v = a2 * (4 * b2 - (__int128)(2 * y - 1) * (2 * y - 1));  // 4ry^2 * x^2 < v
+    return isqrt64((int64_t)((v - 1) / (4 * b2)));
+}
+
+// 次の領域で行yのxが進む先（中点(x + 1/2, y)が楕円の外になる最小のx、0 <= y <= ry）
+static int64_t ellipse_x_at(const __int128 a2, const __int128 b2, const int64_t y){
+    const __int128 u = 4 * a2 * (b2 - (__int128)y * y);  // (2x + 1)^2 * ry^2 > u
+    const int64_t m = isqrt64((int64_t)(u / b2));
+    return (m + 1) / 2;
+}
+
+/*
+ * 中心(x0, y0)、半径rx（横）、ry（縦）の楕円を描く（中点アルゴリズム）
+ * - 1/4楕円を(0, ry)から次の2つの領域に分けてたどったときの点を塗る
+ *   - 傾きが緩やかな間（ry^2 * x < rx^2 * y）はxを1ずつ進め、中点(x + 1, y - 1/2)が
+ *     楕円の外ならyを1減らす
+ *   - その後はyを1ずつ減らし、各行で中点(x + 1/2, y)が楕円の外に出るまでxを進める
+ * - 全体はたどらず、各行の点の範囲（xl..xr）を式から直接求める
+ *   - 最初の領域の列xの点はほぼellipse_y_at(x)だが、境目の近くでは傾きが1を超え、
+ *     1列に1しか減らないyが遅れることがある
+ *   - そこで、ellipse_y_atで境目の列を二分探索し、その2列手前（遅れが始まらない列）
+ *     からの数列だけを実際にたどる（たどった点はtailに記録する）
+ *   - 次の領域の行yの右端は、境目の列xeとellipse_x_at(y)の大きい方で、輪郭の点は
+ *     1つ上の行の右端より右の列だけ（進まなかった行は右端の1点）
+ *   - キャンバス内の行だけを調べるので、巨大な楕円でもキャンバスの大きさに
+ *     比例した時間で終わる
+ * - 輪郭は各行の左右の区間、fillなら行全体（x0 - xrからx0 + xr）を水平な区間として塗る
+ */
+#define ELLIPSE_TAIL 16
+
+static void ellipse(Canvas *c, const int64_t x0, const int64_t y0, const int64_t rx, const int64_t ry, const int fill){
+    if (rx <= 0 || ry <= 0) return;
+    if (x0 + rx < 0 || x0 - rx >= c->width || y0 + ry < 0 || y0 - ry >= c->height) return;  // キャンバスと重ならない
+
+    const __int128 a2 = (__int128)rx * rx;
+    const __int128 b2 = (__int128)ry * ry;
+
+    // ry^2 * x >= rx^2 * ellipse_y_at(x)となる最初の列
+    int64_t lo = 0, hi = rx;
+    while (lo < hi){
+        const int64_t mid = lo + (hi - lo) / 2;
+        if (b2 * mid >= a2 * ellipse_y_at(a2, b2, mid)) hi = mid;
+        else lo = mid + 1;
+    }
+
+    // 境目の手前から最初の領域の終わりまでをたどる（次の領域に入る点が(xe, ye)）
+    const int64_t xs = (lo > 2) ? lo - 2 : 0;
+    int64_t tail_y[ELLIPSE_TAIL];  // 列xs + iの点のy
+    int ntail = 0;
+    int64_t xe = xs;
+    int64_t ye = ellipse_y_at(a2, b2, xs);
+    __int128 f = 4 * b2 * (xe + 1) * (xe + 1) + a2 * (2 * ye - 1) * (2 * ye - 1) - 4 * a2 * b2;
+    while (b2 * xe < a2 * ye && ntail < ELLIPSE_TAIL){
+        tail_y[ntail++] = ye;
+        if (f < 0){
+            f += 4 * b2 * (2 * xe + 3);
+        } else {
+            f += 4 * b2 * (2 * xe + 3) - 8 * a2 * (ye - 1);
+            ye--;
+        }
+        xe++;
+    }
+
+    const int64_t ya = (y0 - ry < 0) ? 0 : y0 - ry;
+    const int64_t yb = (y0 + ry >= c->height) ? c->height - 1 : y0 + ry;
+    for (int64_t py = ya; py <= yb; py++){
+        const int64_t y = llabs(py - y0);
+
+        // 行yの点の範囲xl..xr
+        int64_t xl = INT64_MAX, xr = -1;
+        if (y >= ye){
+            // 最初の領域のうち、式で求まる列（xsより左）
+            const int64_t l = (y == ry) ? 0 : ellipse_x_reach(a2, b2, y + 1) + 1;
+            int64_t r = xs - 1;
+            if (y > 0){
+                const int64_t x = ellipse_x_reach(a2, b2, y);
+                if (x < r) r = x;
+            }
+            if (l <= r){
+                xl = l;
+                xr = r;
+            }
+            // たどった列
+            for (int i = 0; i < ntail; i++){
+                if (tail_y[i] != y) continue;
+                if (xs + i < xl) xl = xs + i;
+                if (xs + i > xr) xr = xs + i;
+            }
+        }
+        int64_t xf = xr;  // fillで塗る半幅
+        if (y <= ye){
+            // 次の領域（行yの点の右端はxeとellipse_x_at(y)の大きい方）
+            const int64_t x = ellipse_x_at(a2, b2, y);
+            const int64_t r = (x > xe) ? x : xe;
+            xf = (r > xf) ? r : xf;
+
+            // 輪郭は、その行で新たに進んだ列だけ（1行に1列ずつ進む中点アルゴリズムと同じ点）
+            // - 行yeは(xe, ye)だけで、次の行から進む
+            // - y = 0の先端の行だけは、平たい楕円でも隙間ができないようrxまで伸ばす
+            int64_t l = xe;
+            int64_t rr = (y == 0) ? r : xe;
+            if (y < ye){
+                const int64_t xp = ellipse_x_at(a2, b2, y + 1);
+                const int64_t prev = (y + 1 < ye && xp > xe) ? xp : xe;
+                l = (r > prev) ? prev + 1 : r;
+                rr = r;
+            }
+            if (l < xl) xl = l;
+            if (rr > xr) xr = rr;
+        }
+
+        if (fill){
+            canvas_hspan(c, x0 - xf, x0 + xf, py, c->pen);
+        } else {
+            canvas_hspan(c, x0 + xl, x0 + xr, py, c->pen);
+            canvas_hspan(c, x0 - xr, x0 - xl, py, c->pen);
+        }
+    }
+}
+
+void draw_ellipse(Canvas *c, const int64_t x0, const int64_t y0, const int64_t rx, const int64_t ry){
+    ellipse(c, x0, y0, rx, ry, 0);
+}
+
+void draw_fillellipse(Canvas *c, const int64_t x0, const int64_t y0, const int64_t rx, const int64_t ry){
+    ellipse(c, x0, y0, rx, ry, 1);
+}
+
+/*
+ * 塗りつぶしで調べる区間
+ * - 行y - dyの[xl, xr]は塗り終わっていて、その隣の行yを調べる
+ */
+typedef struct {
+    int64_t y;
+    int64_t xl;
+    int64_t xr;
+    int64_t dy;  // 1（下に向かう）または-1（上に向かう）
+} FillSpan;
+
+// 塗りつぶしの区間のスタック（ヒープに確保し、足りなくなったら倍にする）
+typedef struct {
+    FillSpan *spans;
+    size_t n;
+    size_t cap;
+    int failed;  // 確保に失敗したか
+} FillStack;
+
+// 調べる行yがキャンバス内なら区間を積む
+static void fill_push(FillStack *st, const Canvas *c, const int64_t y, const int64_t xl, const int64_t xr, const int64_t dy){
+    if (y < 0 || y >= c->height) return;
+    if (st->n == st->cap){
+        const size_t cap = (st->cap == 0) ? 256 : st->cap * 2;
+        FillSpan *spans = (FillSpan *)realloc(st->spans, cap * sizeof(FillSpan));
+        if (spans == NULL){
+            st->failed = 1;
+            return;
+        }
+        st->spans = spans;
+        st->cap = cap;
+    }
+    st->spans[st->n++] = (FillSpan){ .y = y, .xl = xl, .xr = xr, .dy = dy };
+}
 
-    for (int deg = 0; deg < 360; deg++){
-        double rad = deg * M_PI / 180.0;
-        int x = x0 + (int)(r * cos(rad));
-        int y = y0 + (int)(r * sin(rad));
+/*
+ * (x, y)とつながった（上下左右に隣り合う）同じ文字の領域をペンの文字で塗りつぶす
+ * - 区間のスタックを使った走査線塗りつぶし（再帰しない）
+ *   - 区間を取り出し、隣の行で元の文字が続く範囲を左右に広げて
+ *     canvas_hspanで1度に塗る
+ *   - 塗った範囲の隣の行を、来た方向には親の区間からはみ出した部分だけ、
+ *     進む方向には全体を区間として積む
+ * - 塗ったセルは元の文字でなくなるので、同じセルを2度塗ることはない
+ * - 戻り値：成功なら0、ペンの文字を登録できなかったら-1（何も塗らない）、
+ *   スタックを確保できなかったら1（途中まで塗った状態になる）
+ */
+int flood_fill(Canvas *c, const int64_t x, const int64_t y){
+    // パレットへの登録で格納値が変わることがあるので、ペンの格納値を先に求める
+    const int pv = canvas_value_of(c, c->pen);
+    if (pv < 0) return -1;
+    const unsigned from = canvas_value_at(c, x, y);
+    if (from == (unsigned)pv) return 0;
+
+    FillStack st = { .spans = NULL, .n = 0, .cap = 0, .failed = 0 };
+    fill_push(&st, c, y + 1, x, x, 1);
+    fill_push(&st, c, y, x, x, -1);  // 最初に取り出される区間（行yの(x, x)から塗る）
+    while (st.n > 0 && !st.failed){
+        const FillSpan s = st.spans[--st.n];
+        const int64_t sy = s.y;  // 調べる行
+        int64_t l;
+        int64_t px = s.xl;  // 調べている位置
+
+        // 区間の左端から左に広げる
+        while (px >= 0 && canvas_value_at(c, px, sy) == from) px--;
+        if (px < s.xl){
+            l = px + 1;
+            if (l < s.xl) fill_push(&st, c, sy - s.dy, l, s.xl - 1, -s.dy);  // 左にはみ出した部分
+            px = s.xl;
+        } else {
+            // 左端が元の文字でない場合は、区間の中で次に元の文字が始まる位置を探す
+            for (px++; px <= s.xr && canvas_value_at(c, px, sy) != from; px++);
+            l = px;
+            if (px > s.xr) continue;
+        }
 
-        if (x >= 0 && x < c->width && y >= 0 && y < c->height){
-            c->canvas[x][y] = c->pen;
+        while (px <= s.xr){
+            // lから右に広げて塗る
+            int64_t r = px;
+            while (r < c->width && canvas_value_at(c, r, sy) == from) r++;
+            canvas_hspan(c, l, r - 1, sy, c->pen);
+            fill_push(&st, c, sy + s.dy, l, r - 1, s.dy);
+            if (r > s.xr + 1) fill_push(&st, c, sy - s.dy, s.xr + 1, r - 1, -s.dy);  // 右にはみ出した部分
+
+            // 区間の中で次に元の文字が始まる位置
+            for (px = r + 1; px <= s.xr && canvas_value_at(c, px, sy) != from; px++);
+            l = px;
         }
     }
+    free(st.spans);
+    return st.failed ? 1 : 0;
+}
+
+// n個の頂点p[0], p[1], ..., p[2n - 1]（x, yの順）を順に線で結ぶ
+void draw_polyline(Canvas *c, const int64_t *p, const int n){
+    for (int i = 0; i + 1 < n; i++){
+        draw_line(c, p[2 * i], p[2 * i + 1], p[2 * i + 2], p[2 * i + 3]);
+    }
+}
+
+/*
+ * 多角形の塗りつぶしで使う辺
+ * - 上端の行ymin（含む）から下端の行ymax（含まない）までの各行との交点を、
+ *   整数部xと端数num / dyに分けて1行ずつ足し込みで求める
+ */
+typedef struct {
+    int64_t ymin;  // 辺の上端の行
+    int64_t ymax;  // 辺の下端の行（この行は含まない）
+    int64_t x0;    // 上端のx
+    int64_t dx;    // 下端のx - 上端のx
+    int64_t dy;    // ymax - ymin（> 0）
+    int64_t x;     // 現在の行での交点のx（切り捨て）
+    int64_t num;   // 交点のxの端数（0 <= num < dy）
+    int64_t step;  // 1行進むときのxの増分（切り捨て）
+    int64_t rem;   // 1行進むときの端数の増分（0 <= rem < dy）
+} PolyEdge;
+
+// a / b（b > 0）の切り捨て（負の数も小さい方に丸める）
+static int64_t floor_div(const int64_t a, const int64_t b){
+    const int64_t q = a / b;
+    return (a % b < 0) ? q - 1 : q;
+}
+
+// 辺を上端の行の順に並べる（qsort用）
+static int poly_edge_cmp(const void *a, const void *b){
+    const int64_t ya = ((const PolyEdge *)a)->ymin;
+    const int64_t yb = ((const PolyEdge *)b)->ymin;
+    return (ya > yb) - (ya < yb);
+}
+
+// 交点がaの方が左にあるか（整数部、端数の順に比べる）
+static int poly_edge_before(const PolyEdge *a, const PolyEdge *b){
+    return (a->x != b->x) ? a->x < b->x : a->num * b->dy < b->num * a->dy;
+}
+
+/*
+ * n個の頂点p[0], p[1], ..., p[2n - 1]（x, yの順）の多角形を描く
+ * - 輪郭は各辺をdraw_lineで描く（最後の頂点から最初の頂点に戻る）
+ * - fillなら、先に内側を偶奇規則で塗りつぶす
+ *   - 辺を上端の行の順に並べた辺リストを作り、各行でその行にかかる辺
+ *     （活性辺）だけの交点を左から並べ、2つずつ組にした間を水平な区間で塗る
+ *   - 交点は行ごとの足し込みで求め（割り算は活性辺に加えるときだけ）、
+ *     行に入ったときに並べ直す（ほぼ整列済みなので挿入ソート）
+ *   - キャンバスの上下にはみ出した行は調べない
+ *   - 手間は辺の数と塗る行・区間の数に比例する
+ * - 戻り値：成功なら0、辺リストを確保できなかったら-1（何も描かない）
+ */
+int draw_polygon(Canvas *c, const int64_t *p, const int n, const int fill){
+    if (fill){
+        PolyEdge *edges = (PolyEdge *)malloc(sizeof(PolyEdge) * (size_t)n);
+        PolyEdge **active = (PolyEdge **)malloc(sizeof(PolyEdge *) * (size_t)n);
+        if (edges == NULL || active == NULL){
+            free(edges);
+            free(active);
+            return -1;
+        }
+
+        // 辺リスト（水平な辺は交点を作らないので除く）
+        int ne = 0;
+        int64_t bottom = 0;  // 辺の下端の行の最大
+        for (int i = 0; i < n; i++){
+            const int j = (i + 1 < n) ? i + 1 : 0;
+            int64_t xa = p[2 * i], ya = p[2 * i + 1], xb = p[2 * j], yb = p[2 * j + 1];
+            if (ya == yb) continue;
+            if (ya > yb){
+                int64_t t = xa; xa = xb; xb = t;
+                t = ya; ya = yb; yb = t;
+            }
+            PolyEdge *e = &edges[ne++];
+            *e = (PolyEdge){ .ymin = ya, .ymax = yb, .x0 = xa, .dx = xb - xa, .dy = yb - ya };
+            e->step = floor_div(e->dx, e->dy);
+            e->rem = e->dx - e->step * e->dy;
+            if (ne == 1 || yb > bottom) bottom = yb;
+        }
+        qsort(edges, (size_t)ne, sizeof(PolyEdge), poly_edge_cmp);
+
+        int next = 0;     // 次に活性辺に加える辺
+        int nactive = 0;
+        const int64_t last = (bottom - 1 < c->height - 1) ? bottom - 1 : c->height - 1;
+        for (int64_t y = (ne > 0 && edges[0].ymin > 0) ? edges[0].ymin : 0; y <= last; y++){
+            // この行で終わる辺を除く
+            int k = 0;
+            for (int i = 0; i < nactive; i++){
+                if (active[i]->ymax > y) active[k++] = active[i];
+            }
+            nactive = k;
+
+            // この行にかかり始めた辺を加える（上にはみ出した辺は交点をこの行から求める）
+            for (; next < ne && edges[next].ymin <= y; next++){
+                PolyEdge *e = &edges[next];
+                if (e->ymax <= y) continue;
+                const int64_t t = (y - e->ymin) * e->dx;
+                const int64_t q = floor_div(t, e->dy);
+                e->x = e->x0 + q;
+                e->num = t - q * e->dy;
+                active[nactive++] = e;
+            }
+            if (nactive == 0){
+                if (next == ne) break;
+                y = edges[next].ymin - 1;  // 次の辺の上端まで飛ばす
+                continue;
+            }
+
+            // 交点を左から並べる
+            for (int i = 1; i < nactive; i++){
+                PolyEdge *e = active[i];
+                int j = i;
+                for (; j > 0 && poly_edge_before(e, active[j - 1]); j--) active[j] = active[j - 1];
+                active[j] = e;
+            }
+
+            // 交点を2つずつ組にして、その間の画素（両端の交点の内側）を塗る
+            for (int i = 0; i + 1 < nactive; i += 2){
+                const int64_t xl = active[i]->x + (active[i]->num > 0);  // 切り上げ
+                const int64_t xr = active[i + 1]->x;
+                if (xl <= xr) canvas_hspan(c, xl, xr, y, c->pen);
+            }
+
+            // 次の行の交点
+            for (int i = 0; i < nactive; i++){
+                PolyEdge *e = active[i];
+                e->x += e->step;
+                e->num += e->rem;
+                if (e->num >= e->dy){
+                    e->num -= e->dy;
+                    e->x++;
+                }
+            }
+        }
+        free(edges);
+        free(active);
+    }
+
+    draw_polyline(c, p, n);
+    if (n > 2) draw_line(c, p[2 * n - 2], p[2 * n - 1], p[0], p[1]);
+    return 0;
+}
+
+/*
+ * 現在の太さ（c->brush）で(x0, y0)-(x1, y1)の線を描く
+ * - 太さ1ならdraw_lineそのもの
+ * - 太さNの線は、draw_lineの線を短い方の軸の方向に-(N - 1) / 2から+N / 2まで
+ *   ずらしたN本の線を合わせたもの
+ * - 点ごとに太さ分を塗るのではなく、行ごとに1つの水平な区間として塗るので、
+ *   同じ面積の塗りつぶしと同程度の手間で済む（キャンバス内の行だけを調べる）
+ *   - 縦長の線（dy > dx）は、各行の点の左右に広げた区間
+ *   - 横長の線は、各行にかかる点（行からのずれが-N / 2から+(N - 1) / 2まで）の
+ *     範囲で、最初と最後の点は割り算で直接求める
+ *   - 水平・垂直な線は長方形として塗る
+ */
+void draw_brush_line(Canvas *c, const int64_t x0, const int64_t y0, const int64_t x1, const int64_t y1){
+    if (c->brush <= 1){
+        draw_line(c, x0, y0, x1, y1);
+        return;
+    }
+
+    const int64_t a = (c->brush - 1) / 2;  // 左（上）へのずれ
+    const int64_t b = c->brush / 2;        // 右（下）へのずれ
+    if (y0 == y1){
+        canvas_fill_rect(c, (x0 < x1) ? x0 : x1, y0 - a, (x0 < x1) ? x1 : x0, y0 + b, c->pen);
+        return;
+    }
+    if (x0 == x1){
+        canvas_fill_rect(c, x0 - a, (y0 < y1) ? y0 : y1, x0 + b, (y0 < y1) ? y1 : y0, c->pen);
+        return;
+    }
+
+    const int64_t dx = llabs(x1 - x0);
+    const int64_t dy = llabs(y1 - y0);
+    const int64_t sx = (x1 > x0) ? 1 : -1;
+    const int64_t sy = (y1 > y0) ? 1 : -1;
+    const int64_t xmin = (x0 < x1) ? x0 : x1;
+    const int64_t xmax = (x0 < x1) ? x1 : x0;
+    const int64_t ymin = (y0 < y1) ? y0 : y1;
+    const int64_t ymax = (y0 < y1) ? y1 : y0;
+    if (xmax + b < 0 || xmin - a >= c->width || ymax + b < 0 || ymin - a >= c->height) return;  // キャンバスと重ならない
+
+    if (dy > dx){
+        // 行y0 + sy * iの点はx0 + sx * (i * dx / dy)（キャンバス内の行のiだけ）
+        int64_t lo = (sy > 0) ? -y0 : y0 - c->height + 1;
+        int64_t hi = (sy > 0) ? c->height - 1 - y0 : y0;
+        if (lo < 0) lo = 0;
+        if (hi > dy) hi = dy;
+        int64_t x = x0 + sx * (lo * dx / dy);
+        int64_t err = lo * dx % dy;
+        for (int64_t i = lo, y = y0 + sy * lo; i <= hi; i++, y += sy){
+            canvas_hspan(c, x - a, x + b, y, c->pen);
+            err += dx;
+            if (err >= dy){
+                err -= dy;
+                x += sx;
+            }
+        }
+        return;
+    }
+
+    /*
+     * 点iの行はy0 + sy * q（q = i * dy / dx）
+     * - 行yにかかる点は、qがqlo..qhiの点（yからのずれが-b..+a）
+     * - qがqloになる最初の点はceil(qlo * dx / dy)、qhiである最後の点は
+     *   ceil((qhi + 1) * dx / dy) - 1
+     */
+    const int64_t ya = (ymin - a < 0) ? 0 : ymin - a;
+    const int64_t yb = (ymax + b >= c->height) ? c->height - 1 : ymax + b;
+    for (int64_t y = ya; y <= yb; y++){
+        int64_t qlo = (sy > 0) ? y - b - y0 : y0 - y - a;
+        int64_t qhi = (sy > 0) ? y + a - y0 : y0 - y + b;
+        if (qlo < 0) qlo = 0;
+        if (qhi > dy) qhi = dy;
+        if (qlo > qhi) continue;
+        const int64_t ia = (qlo * dx + dy - 1) / dy;
+        int64_t ib = ((qhi + 1) * dx - 1) / dy;
+        if (ib > dx) ib = dx;
+        canvas_hspan(c, x0 + sx * ia, x0 + sx * ib, y, c->pen);
+    }
 }
 
 void save_history(const char *filename, History *his)
@@ -444,6 +3214,7 @@ Result load_history(const char *filename, History *his, Canvas *c){
     }
 
     reset_canvas(c);
+    c->brush = 1;  // 線の太さは履歴の中のbrushコマンドで設定し直す
 
     // 履歴ファイルの内容を読み込む
     char buf[his->bufsize];
@@ -465,10 +3236,21 @@ Result load_history(const char *filename, History *his, Canvas *c){
         if (cmd != NULL){
             if (strcmp(cmd, "line") == 0 || 
                 strcmp(cmd, "rect") == 0 ||
+                strcmp(cmd, "fillrect") == 0 ||
                 strcmp(cmd, "circle") == 0 ||
-                strcmp(cmd, "chpen") == 0){
-
-                    char *new_str = (char*)malloc(his->bufsize);
+                strcmp(cmd, "fillcircle") == 0 ||
+                strcmp(cmd, "ellipse") == 0 ||
+                strcmp(cmd, "fillellipse") == 0 ||
+                strcmp(cmd, "fill") == 0 ||
+                strcmp(cmd, "polyline") == 0 ||
+                strcmp(cmd, "polygon") == 0 ||
+                strcmp(cmd, "chpen") == 0 ||
+                strcmp(cmd, "brush") == 0 ||
+                strcmp(cmd, "recolor") == 0){
+
+                    // 履歴にはコマンドの長さの分だけ確保する
+                    const size_t len = strlen(buf) + 1;
+                    char *new_str = (char*)malloc(len);
 
                     if (new_str == NULL){
                         fprintf(stderr, "error: memory allocation failed.\n");
@@ -479,7 +3261,7 @@ Result load_history(const char *filename, History *his, Canvas *c){
                     strcpy(new_str, buf);
 
                     Result r = interpret_command(new_str, his, c);
-                    if (r == ERRNONINT || r == ERRLACKARGS){
+                    if (r == ERRNONINT || r == ERRLACKARGS || r == ERRRANGE){
                         free(new_str);
                         fclose(fp);
                         return r;
@@ -496,7 +3278,7 @@ Result load_history(const char *filename, History *his, Canvas *c){
                     // コマンドをCommand構造体の形にする
                     *cmd = (Command){
                         .str = new_str,
-                        .bufsize = his->bufsize,
+                        .bufsize = len,
                         .next = NULL
                     };
 
@@ -517,6 +3299,71 @@ Result load_history(const char *filename, History *his, Canvas *c){
     return LOAD;
 }
 
+/*
+ * strtokで区切られた残りの引数からn個の整数を読み取りpに格納する
+ * - 引数が足りなければERRLACKARGS、整数でなければERRNONINT
+ * - 絶対値がCOORD_MAXを超える値はERRRANGE
+ * - すべて読めた場合はNOCOMMAND（エラーなし）を返す
+ */
+Result read_int_args(int64_t *p, const int n){
+    char *b[n];
+    for (int i = 0; i < n; i++){
+        b[i] = strtok(NULL, " ");
+        if (b[i] == NULL){
+            return ERRLACKARGS;
+        }
+    }
+    for (int i = 0; i < n; i++){
+        char *e;
+        errno = 0;
+        long long v = strtoll(b[i], &e, 10);
+        if (*e != '\0'){
+            return ERRNONINT;
+        }
+        if (errno == ERANGE || v < -COORD_MAX || v > COORD_MAX){
+            return ERRRANGE;
+        }
+        p[i] = (int64_t)v;
+    }
+    return NOCOMMAND;
+}
+
+/*
+ * strtokで区切られた残りの引数をすべて整数として読み取りpに格納する
+ * - 読み取った個数をnに入れる（max個を超えたらERRRANGE）
+ * - fillがNULLでなければ、最後の引数に限り"fill"を受け付け、*fillを1にする
+ * - 整数の扱いとエラーはread_int_argsと同じ
+ */
+Result read_int_list(int64_t *p, const int max, int *n, int *fill){
+    *n = 0;
+    if (fill != NULL){
+        *fill = 0;
+    }
+    for (char *b = strtok(NULL, " "); b != NULL; b = strtok(NULL, " ")){
+        if (fill != NULL && strcmp(b, "fill") == 0){
+            if (strtok(NULL, " ") != NULL){
+                return UNKNOWN;
+            }
+            *fill = 1;
+            break;
+        }
+        if (*n >= max){
+            return ERRRANGE;
+        }
+        char *e;
+        errno = 0;
+        long long v = strtoll(b, &e, 10);
+        if (*e != '\0'){
+            return ERRNONINT;
+        }
+        if (errno == ERANGE || v < -COORD_MAX || v > COORD_MAX){
+            return ERRRANGE;
+        }
+        p[(*n)++] = (int64_t)v;
+    }
+    return NOCOMMAND;
+}
+
 Result interpret_command(const char *command, History *his, Canvas *c)
 {
     char buf[his->bufsize];
@@ -555,6 +3402,46 @@ Result interpret_command(const char *command, History *his, Canvas *c)
         return CHPEN;
     }
 
+    // brushコマンドを認識して、線の太さを変える（line / rect / circleに使う）
+    if (strcmp(s, "brush") == 0){
+        int64_t p[1] = {0};
+        const Result r = read_int_args(p, 1);
+        if (r != NOCOMMAND){
+            return r;
+        }
+        if (strtok(NULL, " ") != NULL){
+            return UNKNOWN;
+        }
+        if (p[0] < 1 || p[0] > BRUSH_MAX){
+            return ERRRANGE;
+        }
+
+        c->brush = p[0];
+        return BRUSH;
+    }
+
+    // recolorコマンドを認識して、キャンバス上の文字を置き換える
+    if (strcmp(s, "recolor") == 0){
+        char *from = strtok(NULL, " ");
+        char *to = strtok(NULL, " ");
+
+        if (from == NULL || to == NULL){
+            return ERRLACKARGS;
+        }
+
+        // どちらも1文字であること
+        if (from[1] != '\0' || to[1] != '\0'){
+            return ERRLACKARGS;
+        }
+
+        if (strtok(NULL, " ") != NULL){
+            return UNKNOWN;
+        }
+
+        canvas_recolor(c, from[0], to[0]);
+        return RECOLOR;
+    }
+
     // loadコマンドを認識して、load_historyを実行する
     if (strcmp(s, "load") == 0){
         const char *filename = strtok(NULL, " ");
@@ -565,75 +3452,205 @@ Result interpret_command(const char *command, History *his, Canvas *c)
         return load_history(filename, his, c);
     }
 
-    // rectコマンドを認識して、draw_rectを実行する
-    if (strcmp(s, "rect") == 0){
-        int p[4] = {0};
-        char *b[4];
+    // viewコマンドを認識して、表示範囲を左上(x, y)、幅w、高さhにする
+    if (strcmp(s, "view") == 0){
+        int64_t p[4] = {0};
+        const Result r = read_int_args(p, 4);
+        if (r != NOCOMMAND){
+            return r;
+        }
+        if (p[2] < 1 || p[3] < 1){
+            return ERRRANGE;
+        }
 
-        for (int i = 0; i < 4; ++i){
-            b[i] = strtok(NULL, " ");
-            if (b[i] == NULL){
-                return ERRLACKARGS;
+        canvas_set_view(c, p[0], p[1], p[2], p[3]);
+        return VIEW;
+    }
+
+    // panコマンドを認識して、表示範囲を表示上の(dx, dy)セルだけずらす
+    if (strcmp(s, "pan") == 0){
+        int64_t p[2] = {0};
+        const Result r = read_int_args(p, 2);
+        if (r != NOCOMMAND){
+            return r;
+        }
+
+        canvas_move_view(c, c->view.x0 + p[0] * canvas_cell_w(c), c->view.y0 + p[1] * canvas_cell_h(c));
+        return VIEW;
+    }
+
+    // zoomコマンドを認識して、縮小表示を切り替える
+    // - zoom out N: N x Nセルを1セルにまとめて表示する
+    // - zoom in: 等倍の表示に戻す
+    if (strcmp(s, "zoom") == 0){
+        const char *dir = strtok(NULL, " ");
+        if (dir == NULL){
+            return ERRLACKARGS;
+        }
+
+        if (strcmp(dir, "in") == 0){
+            if (strtok(NULL, " ") != NULL){
+                return UNKNOWN;
             }
+            canvas_set_zoom(c, 1);
+            return VIEW;
         }
-        for (int i = 0; i < 4; ++i){
-            char *e;
-            long v = strtol(b[i], &e, 10);
-            if (*e != '\0'){
-                return ERRNONINT;
+
+        if (strcmp(dir, "out") == 0){
+            int64_t p[1] = {0};
+            const Result r = read_int_args(p, 1);
+            if (r != NOCOMMAND){
+                return r;
+            }
+            if (p[0] < 1){
+                return ERRRANGE;
             }
-            p[i] = (int)v;
+            canvas_set_zoom(c, p[0]);
+            return VIEW;
+        }
+        return UNKNOWN;
+    }
+
+    // brailleコマンドを認識して、点字表示を切り替える（braille on / braille off）
+    if (strcmp(s, "braille") == 0){
+        const char *sw = strtok(NULL, " ");
+        if (sw == NULL){
+            return ERRLACKARGS;
+        }
+        if (strtok(NULL, " ") != NULL){
+            return UNKNOWN;
+        }
+
+        if (strcmp(sw, "on") == 0){
+            canvas_set_braille(c, 1);
+        } else if (strcmp(sw, "off") == 0){
+            canvas_set_braille(c, 0);
+        } else {
+            return UNKNOWN;
+        }
+        return VIEW;
+    }
+
+    // rectコマンドを認識して、draw_rectを実行する
+    if (strcmp(s, "rect") == 0){
+        int64_t p[4] = {0};
+        const Result r = read_int_args(p, 4);
+        if (r != NOCOMMAND){
+            return r;
         }
 
         draw_rect(c, p[0], p[1], p[2], p[3]);
         return RECT;
     }
 
+    // fillrectコマンドを認識して、draw_fillrectを実行する
+    if (strcmp(s, "fillrect") == 0){
+        int64_t p[4] = {0};
+        const Result r = read_int_args(p, 4);
+        if (r != NOCOMMAND){
+            return r;
+        }
+
+        draw_fillrect(c, p[0], p[1], p[2], p[3]);
+        return FILLRECT;
+    }
+
     // circleコマンドを認識して、draw_circleを実行する
     if (strcmp(s, "circle") == 0){
-        int p[3] = {0};
-        char *b[3];
+        int64_t p[3] = {0};
+        const Result r = read_int_args(p, 3);
+        if (r != NOCOMMAND){
+            return r;
+        }
 
-        for (int i = 0; i < 3; ++i){
-            b[i] = strtok(NULL, " ");
-            if (b[i] == NULL){
-                return ERRLACKARGS;
-            }
+        draw_circle(c, p[0], p[1], p[2]);
+        return CIRCLE;
+    }
+
+    // fillcircleコマンドを認識して、draw_fillcircleを実行する
+    if (strcmp(s, "fillcircle") == 0){
+        int64_t p[3] = {0};
+        const Result r = read_int_args(p, 3);
+        if (r != NOCOMMAND){
+            return r;
         }
 
-        for (int i = 0; i < 3; ++i){
-            char *e;
-            long v = strtol(b[i], &e, 10);
-            if (*e != '\0'){
-                return ERRNONINT;
-            }
-            p[i] = (int)v;
+        draw_fillcircle(c, p[0], p[1], p[2]);
+        return FILLCIRCLE;
+    }
+
+    // ellipse / fillellipseコマンドを認識して、draw_ellipse / draw_fillellipseを実行する
+    if (strcmp(s, "ellipse") == 0 || strcmp(s, "fillellipse") == 0){
+        int64_t p[4] = {0};
+        const Result r = read_int_args(p, 4);
+        if (r != NOCOMMAND){
+            return r;
         }
 
-        draw_circle(c, p[0], p[1], p[2]);
-        return CIRCLE;
+        if (s[0] == 'f'){
+            draw_fillellipse(c, p[0], p[1], p[2], p[3]);
+            return FILLELLIPSE;
+        }
+        draw_ellipse(c, p[0], p[1], p[2], p[3]);
+        return ELLIPSE;
+    }
+
+    // fillコマンドを認識して、flood_fillを実行する
+    if (strcmp(s, "fill") == 0){
+        int64_t p[2] = {0};
+        const Result r = read_int_args(p, 2);
+        if (r != NOCOMMAND){
+            return r;
+        }
+        if (!canvas_contains(c, p[0], p[1])){
+            return ERRRANGE;
+        }
+
+        // 途中までしか塗れなくても塗った分はキャンバスに残るので、履歴に残す
+        const int ret = flood_fill(c, p[0], p[1]);
+        if (ret < 0){
+            return ERRFILE;
+        }
+        return (ret > 0) ? FILLPARTIAL : FILL;
+    }
+
+    // polyline / polygonコマンドを認識して、draw_polyline / draw_polygonを実行する
+    // - 頂点の座標をx y x y ...と並べる（polygonは最後に"fill"を付けると塗りつぶす）
+    if (strcmp(s, "polyline") == 0 || strcmp(s, "polygon") == 0){
+        const int polygon = (s[4] == 'g');
+        int64_t p[his->bufsize / 2];
+        int n = 0;
+        int fill = 0;
+        const Result r = read_int_list(p, (int)(his->bufsize / 2), &n, polygon ? &fill : NULL);
+        if (r != NOCOMMAND){
+            return r;
+        }
+        if (n % 2 != 0){
+            return ERRLACKARGS;
+        }
+        if (n < (polygon ? 6 : 4)){
+            return ERRLACKARGS;
+        }
+
+        if (!polygon){
+            draw_polyline(c, p, n / 2);
+            return POLYLINE;
+        }
+        if (draw_polygon(c, p, n / 2, fill) != 0){
+            return ERRFILE;  // 何も描いていないので履歴にも残さない
+        }
+        return POLYGON;
     }
 
     // lineコマンドを認識して、draw_lineを実行する
     if (strcmp(s, "line") == 0) {
-	int p[4] = {0}; // p[0]: x0, p[1]: y0, p[2]: x1, p[3]: x1 
-	char *b[4];
-	for (int i = 0 ; i < 4; i++){
-	    b[i] = strtok(NULL, " ");
-	    if (b[i] == NULL){
-		return ERRLACKARGS;
-	    }
-	}
-	for (int i = 0 ; i < 4 ; i++){
-	    char *e;
-	    long v = strtol(b[i],&e, 10);
-	    if (*e != '\0'){
-		return ERRNONINT;
-	    }
-	    p[i] = (int)v;
+	int64_t p[4] = {0}; // p[0]: x0, p[1]: y0, p[2]: x1, p[3]: x1 
+	const Result r = read_int_args(p, 4);
+	if (r != NOCOMMAND){
+	    return r;
 	}
 	
-	draw_line(c,p[0],p[1],p[2],p[3]);
+	draw_brush_line(c,p[0],p[1],p[2],p[3]);
 	return LINE;
     }
     
@@ -647,6 +3664,7 @@ Result interpret_command(const char *command, History *his, Canvas *c)
     // undoコマンドを認識して、これを実行する
     if (strcmp(s, "undo") == 0) {
 	reset_canvas(c);
+	c->brush = 1;  // 線の太さは履歴の中のbrushコマンドで設定し直す
 	//[*] 線形リストの先頭からスキャンして逐次実行
 	// pop_back のスキャン中にinterpret_command を絡めた感じ
 	Command *p = his->begin;
@@ -683,10 +3701,11 @@ Result interpret_command(const char *command, History *his, Canvas *c)
 // [*] 線形リストの末尾にpush する
 Command *push_command(History *his, const char *str){
     Command *c = (Command*)malloc(sizeof(Command));
-    char *s = (char*)malloc(his->bufsize);
+    const size_t len = strlen(str) + 1;  // 頂点の多いコマンドもあるので長さの分だけ確保
+    char *s = (char*)malloc(len);
     strcpy(s, str);
     
-    *c = (Command){ .str = s, .bufsize = his->bufsize, .next = NULL};
+    *c = (Command){ .str = s, .bufsize = len, .next = NULL};
     
     Command *p = his->begin;
     
@@ -714,10 +3733,32 @@ char *strresult(Result res){
 	return "1 line drawn";
     case RECT:
     return "1 rectangle drawn";
+    case FILLRECT:
+    return "1 filled rectangle drawn";
     case CIRCLE:
     return "1 circle drawn";
+    case FILLCIRCLE:
+    return "1 filled circle drawn";
+    case ELLIPSE:
+    return "1 ellipse drawn";
+    case FILLELLIPSE:
+    return "1 filled ellipse drawn";
+    case FILL:
+    return "1 region filled";
+    case FILLPARTIAL:
+    return "region partially filled (memory not allocated)";
+    case POLYLINE:
+    return "1 polyline drawn";
+    case POLYGON:
+    return "1 polygon drawn";
     case CHPEN:
     return "pen changed";
+    case BRUSH:
+    return "brush changed";
+    case RECOLOR:
+    return "pen recolored";
+    case VIEW:
+    return "view changed";
     case UNDO:
 	return "undo!";
     case UNKNOWN:
@@ -726,6 +3767,8 @@ char *strresult(Result res){
 	return "Non-int value is included";
     case ERRLACKARGS:
 	return "Too few arguments";
+    case ERRRANGE:
+	return "Value out of range";
     case ERRFILE:
     return "file not open or memory not allocated";
     case NOCOMMAND:
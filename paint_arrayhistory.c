@@ -28,6 +28,10 @@ typedef struct {
     int height;     // キャンバスの高さ  
     char **canvas;  // 描画領域（2次元配列）  
     char pen;       // 描画に使用する文字（デフォルト: '*'）  
+    int used_x0;    // 描画済みの範囲（左上のx、何も描いていなければ width）  
+    int used_y0;    // 描画済みの範囲（左上のy、何も描いていなければ height）  
+    int used_x1;    // 描画済みの範囲（右下のx、何も描いていなければ -1）  
+    int used_y1;    // 描画済みの範囲（右下のy、何も描いていなければ -1）  
 } Canvas;  
 
 /* コマンド履歴を管理する構造体 */  
@@ -43,6 +47,7 @@ Canvas *init_canvas(int width, int height, char pen);
 void reset_canvas(Canvas *c);  
 void print_canvas(Canvas *c);  
 void free_canvas(Canvas *c);  
+void mark_used(Canvas *c, const int x, const int y);  
 
 /* 画面制御用の関数のプロトタイプ宣言 */  
 void rewind_screen(unsigned int line);  
@@ -313,6 +318,12 @@ Canvas *init_canvas(int width,int height, char pen) {
     
     new->pen = pen;  // 描画用文字を設定  
 
+    /* 描画済みの範囲は空にしておく */  
+    new->used_x0 = width;  
+    new->used_y0 = height;  
+    new->used_x1 = -1;  
+    new->used_y1 = -1;  
+
     return new;  // 初期化されたキャンバスを返す  
 }  
 
@@ -326,34 +337,42 @@ Canvas *init_canvas(int width,int height, char pen) {
  *  
  * 動作の詳細：  
  * 1. キャンバスの2次元配列は、実際には1次元のメモリブロックとして確保されている  
- * 2. c->canvas[0]は、その1次元メモリブロックの先頭を指している  
- * 3. memsetで一括して空白文字でクリアする  
+ * 2. canvas[x]はx列目（height文字）の先頭を指している  
+ * 3. 描画済みの範囲（used_x0..used_x1, used_y0..used_y1）の外は既に空白なので、  
+ *    その範囲の列だけをmemsetで空白文字に戻す  
+ *  
+ * 注意：この方法が効率的な理由  
+ * - undoのたびにキャンバス全体（width * height 文字）を消去しなくて済む  
+ * - 大きなキャンバスに小さな絵を描いている場合、消去の量は絵の大きさだけになる  
  */  
 void reset_canvas(Canvas *c) {  
-    /* キャンバスのサイズを局所変数として保存 */  
-    const int width = c->width;   // キャンバスの幅  
-    const int height = c->height; // キャンバスの高さ  
+    /* 何も描いていなければ消去するものはない */  
+    if (c->used_x1 < 0) {  
+        return;  
+    }  
 
-    /*  
-     * memsetによるキャンバスのクリア  
-     *   
-     * 引数1: c->canvas[0] - クリアを開始するメモリアドレス  
-     *        canvas[0]は2次元配列の先頭要素（1次元メモリブロックの開始位置）  
-     *  
-     * 引数2: ' ' (スペース) - 埋める値  
-     *        キャンバスを空白文字でクリア  
-     *  
-     * 引数3: width * height * sizeof(char) - クリアするバイト数  
-     *        - width * height: キャンバス全体の要素数  
-     *        - sizeof(char): 各要素のサイズ（通常は1バイト）  
-     *        これにより、キャンバス全体が一度にクリアされる  
-     *  
-     * 注意：この方法が効率的な理由  
-     * - 2次元配列を行や列ごとにループする必要がない  
-     * - メモリを連続的にアクセスするため高速  
-     * - 1回のmemset呼び出しで完了  
-     */  
-    memset(c->canvas[0], ' ', width*height*sizeof(char));  
+    /* 描画済みの範囲の各列を空白文字でクリア */  
+    const int rows = c->used_y1 - c->used_y0 + 1;  // 1列あたりの消去する文字数  
+    for (int x = c->used_x0 ; x <= c->used_x1 ; x++) {  
+        memset(c->canvas[x] + c->used_y0, ' ', rows * sizeof(char));  
+    }  
+
+    /* 描画済みの範囲を空に戻す */  
+    c->used_x0 = c->width;  
+    c->used_y0 = c->height;  
+    c->used_x1 = -1;  
+    c->used_y1 = -1;  
+}  
+
+/*  
+ * 描画済みの範囲に(x, y)を加える  
+ * - reset_canvasで消去する範囲を最小限にするために使う  
+ */  
+void mark_used(Canvas *c, const int x, const int y) {  
+    if (x < c->used_x0) c->used_x0 = x;  
+    if (y < c->used_y0) c->used_y0 = y;  
+    if (x > c->used_x1) c->used_x1 = x;  
+    if (y > c->used_y1) c->used_y1 = y;  
 }  
 
 /*   
@@ -490,13 +509,17 @@ void draw_line(Canvas *c, const int x0, const int y0, const int x1, const int y1
     char pen = c->pen;  
     
     const int n = max(abs(x1 - x0), abs(y1 - y0));  // 描画点の数  
-    if ( (x0 >= 0) && (x0 < width) && (y0 >= 0) && (y0 < height))  
+    if ( (x0 >= 0) && (x0 < width) && (y0 >= 0) && (y0 < height)) {  
         c->canvas[x0][y0] = pen;  
+        mark_used(c, x0, y0);  
+    }  
     for (int i = 1; i <= n; i++) {  
         const int x = x0 + i * (x1 - x0) / n;  // x座標を線形補間  
         const int y = y0 + i * (y1 - y0) / n;  // y座標を線形補間  
-        if ( (x >= 0) && (x< width) && (y >= 0) && (y < height))  
+        if ( (x >= 0) && (x< width) && (y >= 0) && (y < height)) {  
             c->canvas[x][y] = pen;  
+            mark_used(c, x, y);  
+        }  
     }  
 }  
 